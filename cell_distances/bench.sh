@@ -0,0 +1,75 @@
+#!/bin/sh
+# Benchmark of cell_distances on generated data. For every number of rows a
+# cells file is generated, its reference histogram computed once, and then
+# cell_distances is timed for every thread count. Every run is checked against
+# the reference. Prints CSV on stdout, with speedup and efficiency relative to
+# the first thread count.
+#
+# Usage: bench.sh [-n "rows..."] [-t "threads..."] [-d distribution] [-s seed] [-r repeats] [-f format] [-- args]
+# Arguments after -- are passed to cell_distances (e.g. -- -k avx2), -f to all programs.
+# Build first with: make all tools
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+rows_list="10000 50000 100000"
+threads_list="1 2 4 8"
+distribution=uniform
+seed=1
+repeats=3
+format=2.3,0.01,10
+
+while getopts "n:t:d:s:r:f:" opt; do
+    case $opt in
+        n) rows_list=$OPTARG ;;
+        t) threads_list=$OPTARG ;;
+        d) distribution=$OPTARG ;;
+        s) seed=$OPTARG ;;
+        r) repeats=$OPTARG ;;
+        f) format=$OPTARG ;;
+        *) sed -n '8,10s/^# //p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ "$1" = "--" ] && shift
+
+# cell_distances reads ./cells, so every run happens in a scratch directory
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+# Current time in seconds
+now() { date +%s.%N; }
+
+check=""
+case " $* " in *" -e "*) check="-e" ;; esac
+
+echo "rows,threads,seconds,pairs_per_second,speedup,efficiency"
+for rows in $rows_list; do
+    "$here/gen_cells" -n "$rows" -s "$seed" -d "$distribution" -f "$format" -o cells
+    "$here/check_cells" $check -f "$format" cells > reference
+    # A first run writes the binary cache so that all timed runs see the same input
+    "$here/cell_distances" -f "$format" "$@" > /dev/null
+
+    base=""
+    for threads in $threads_list; do
+        best=""
+        i=0
+        while [ $i -lt "$repeats" ]; do
+            start=$(now)
+            "$here/cell_distances" -t "$threads" -f "$format" "$@" > output
+            end=$(now)
+            if ! cmp -s output reference; then
+                echo "cell_distances -t $threads $* differs from the reference for $rows rows" >&2
+                exit 1
+            fi
+            best=$(awk -v a="$start" -v b="$end" -v best="$best" \
+                       'BEGIN { t = b - a; if (best != "" && best < t) t = best; printf "%.6f", t }')
+            i=$((i + 1))
+        done
+        [ -z "$base" ] && base_threads=$threads && base=$best
+        awk -v n="$rows" -v t="$threads" -v s="$best" -v b="$base" -v bt="$base_threads" \
+            'BEGIN { speedup = b / s;
+                     printf "%d,%d,%.6f,%.0f,%.3f,%.3f\n", n, t, s, n * (n - 1) / 2 / s,
+                            speedup, speedup * bt / t }'
+    done
+done
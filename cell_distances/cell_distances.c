@@ -2,158 +2,1145 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <math.h>
+#include <threads.h>
 #include <omp.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#include "cell_format.h"
+#include "distance_kernels.h"
+
+// Points of a block in structure-of-arrays layout
+typedef struct {
+    int16_t* x;
+    int16_t* y;
+    int16_t* z;
+} points_t;
+
+// Per-thread histogram that lives for the whole run. Every SIMD lane has a
+// 32-bit sub-histogram; they spill into the 64-bit totals before a counter
+// could overflow. Aligned so that threads never share a cache line.
+typedef struct {
+    _Alignas(64) uint32_t* sub; // n_lanes sub-histograms of lane_stride counters
+    uint64_t* spill; // lane_stride totals
+    uint64_t pending; // pairs counted in sub since the last spill
+    int n_lanes;
+} thread_hist_t;
+
+// Header of the binary point cache written next to the cells file (cells.cellbin).
+// It is followed by the x, y and z arrays of rows int16_t each.
+typedef struct {
+    char magic[8]; // "CELLBIN3"
+    uint64_t rows;
+    uint32_t int_digits; // format the rows were parsed with
+    uint32_t frac_digits;
+    uint64_t max_coord; // range every coordinate was checked against while parsing
+    uint64_t source_inode; // identity, size and modification time of cells when the cache was written
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t checksum; // cellbin_checksum of the three arrays
+} cellbin_header_t;
+
+// Source of the rows of the cells file, either read block by block into
+// buffer or mapped into memory once. When a valid binary cache exists its
+// arrays are mapped instead and no text is read at all.
+typedef struct {
+    FILE* fp;
+    char* buffer; // rows read by input_rows, only used when not mapped
+    int buffer_rows;
+    char* map;    // the whole file, NULL when not mapped
+    size_t map_size;
+
+    void* bin_map; // mapped binary cache, NULL when not used
+    size_t bin_map_size;
+    points_t bin_points; // the arrays inside bin_map
+
+    // Binary cache written while the first pass parses the file in order
+    int bin_fd; // -1 when no cache is being written
+    char bin_path[4096];
+    cellbin_header_t bin_header;
+    uint64_t bin_hash[3];
+    long bin_next_row;
+    struct stat source_st; // the cells file when it was opened
+
+    mtx_t lock; // serializes reads into buffer, which share the position of fp
+    bool parallel_parse; // false when parsing inside a block pair task
+} cells_input_t;
+
+// Header of the histogram state saved by incremental runs (-s), followed by
+// n_bins uint64_t counts
+typedef struct {
+    char magic[8]; // "CELLHST2"
+    uint64_t rows; // rows counted so far
+    uint64_t fingerprint; // cellbin_checksum of the points of those rows
+    uint64_t n_bins;
+    uint64_t bin_units; // binning the counts were made with
+    uint64_t exact;
+} hist_state_header_t;
+
+// Tile of the cross-block pair space: rows own points against cols cross points
+typedef struct {
+    int rows;
+    int cols;
+} tile_t;
+
+// Blocks of the run. Block b holds the rows_of[b] rows of input_of[b]
+// starting at row first_of[b]. Block row k pairs block k with itself and
+// every later block, or with every block from cross_from on if it is set.
+typedef struct {
+    cells_input_t* const* input_of;
+    const long* first_of;
+    const int* rows_of;
+    int n_blocks;
+    int block_size; // rows of the largest block
+    int cross_from; // first cross block of every block row, -1 for the blocks after k
+} block_layout_t;
+
+// A block loaded by a thread
+typedef struct {
+    int block; // -1 while empty
+    long last_use;
+    points_t points; // in entries, or in place in the binary cache
+    int16_t* entries;
+} cached_block_t;
+
+// The blocks most recently used by one thread. Consecutive block pairs of a
+// thread mostly share their own block, which is then loaded only once.
+typedef struct {
+    cached_block_t* blocks;
+    int n_blocks;
+    long uses;
+    double load_time; // spent reading and parsing
+} block_cache_t;
+
+// Parser of n_rows rows of text into points
+typedef int (*parse_rows_t)(points_t, const char*, int);
 
 // Function prototypes
-static inline void parse_coord(int16_t*, char*);
-void parse_points(int16_t*, char*, int);
-static inline int distances_3d(int16_t*, int16_t*);
+static inline int parse_coord(int16_t*, const char*, int, int);
+parse_rows_t select_parse_rows(const cell_format_t*);
+int parse_points(points_t, char*, int, bool);
+int input_open(cells_input_t*, const char*, bool, bool, bool, uint32_t*);
+char* input_rows(cells_input_t*, long, int);
+points_t input_points(cells_input_t*, long, int, points_t);
+void input_prepare(cells_input_t*, long, int, points_t);
+void input_close(cells_input_t*);
+int assign_block_rows(int, int, int, int*);
+int layout_blocks(long, long, int, long*, int*, int);
+static inline int layout_first_cross(const block_layout_t*, int);
+block_cache_t* block_caches_create(int, int);
+const cached_block_t* block_cache_get(block_cache_t*, const block_layout_t*, int);
+void block_caches_free(block_cache_t*, int);
+void fingerprint_points(cells_input_t*, long, long, int, points_t, uint64_t*, uint64_t*);
+bool state_load(const char*, hist_state_header_t*, size_t*);
+void state_save(const char*, uint64_t, uint64_t, const size_t*);
+static inline points_t points_at(points_t, int);
+thread_hist_t* thread_hists_create(int, int);
+void thread_hist_spill(thread_hist_t*);
+void thread_hists_merge(thread_hist_t*, int, size_t*);
+void thread_hists_free(thread_hist_t*, int);
+static inline void count_row(thread_hist_t*, points_t, points_t, int);
+void count_block_self(points_t, int, int, int, thread_hist_t*);
+tile_t tile_autotune(int);
+void count_block_cross(points_t, int, int, points_t, int, tile_t, thread_hist_t*);
+void count_block_pair(const block_layout_t*, block_cache_t*, thread_hist_t*, tile_t, int, int, int, int);
+
+// Row kernel picked at startup from the CPU features and its number of lanes
+row_kernel_t row_kernel;
+int row_kernel_lanes;
+bool exact_binning = false; // bin with integers only (-e)
+
+// Layout of the rows and binning, set up from the format descriptor (-f)
+cell_format_t format;
+parse_rows_t parse_rows; // parser specialized for the digits of the format
+int row_size; // 24 for +dd.ddd
+int max_dist; // number of bins, by default 3465 as there are 20*sqrt(3) possible values
 
 // Constants
-const int row_size = 24;
 const int cols = 3;
-const int max_dist = 3465; // there are 20*sqrt(3) possible values
+const char cellbin_magic[8] = "CELLBIN3";
+const char state_magic[8] = "CELLHST2";
 
-// Function to parse a single coordinate from a string
-static inline 
-void parse_coord(int16_t* coord, char* const str)
+// Function to parse a single coordinate with int_digits.frac_digits digits from
+// a string. Called with constant digit counts the loops fold into fixed digit
+// arithmetic, as for the original +dd.ddd parser. Returns the absolute value
+// in units, which the caller checks against the range before it is used.
+static inline __attribute__((always_inline))
+int parse_coord(int16_t* coord, const char* const str, const int int_digits, const int frac_digits)
 {
+    int value = 0;
+    for (int d = 1; d <= int_digits; d++)
+        value = value * 10 + (str[d] - '0');
+    for (int d = int_digits + 2; d < int_digits + 2 + frac_digits; d++)
+        value = value * 10 + (str[d] - '0');
+
     // Determine if the coordinate is negative
-    if (str[0] == 45){
-        *coord = -((str[1] - '0') * (int16_t)10000 +
-                   (str[2] - '0') * (int16_t)1000 +
-                   (str[4] - '0') * (int16_t)100 +
-                   (str[5] - '0') * (int16_t)10 +
-                   (str[6] - '0'));
+    *coord = (int16_t)(str[0] == 45 ? -value : value);
+    return value;
+}
+
+// Function to parse n_rows rows of coordinates with the given digits. Returns
+// the largest absolute coordinate in units.
+static inline __attribute__((always_inline))
+int parse_rows_of(points_t arr, const char* str, int n_rows, const int int_digits, const int frac_digits)
+{
+    const int coord_size = int_digits + frac_digits + 3; // sign, point and separator
+    int max_abs = 0;
+    for (int i = 0; i < n_rows; i++){
+        const char* coord_str = str + (size_t) i * 3 * coord_size;
+        int x = parse_coord(arr.x + i, coord_str, int_digits, frac_digits);
+        int y = parse_coord(arr.y + i, coord_str + coord_size, int_digits, frac_digits);
+        int z = parse_coord(arr.z + i, coord_str + 2 * coord_size, int_digits, frac_digits);
+        max_abs = x > max_abs ? x : max_abs;
+        max_abs = y > max_abs ? y : max_abs;
+        max_abs = z > max_abs ? z : max_abs;
     }
-    else{
-        *coord = ((str[1] - '0') * (int16_t)10000 +
-                  (str[2] - '0') * (int16_t)1000 +
-                  (str[4] - '0') * (int16_t)100 +
-                  (str[5] - '0') * (int16_t)10 +
-                  (str[6] - '0'));
+    return max_abs;
+}
+
+// Parsers specialized at compile time for the common formats
+#define DEFINE_PARSE_ROWS(INT, FRAC) \
+    static int parse_rows_##INT##_##FRAC(points_t arr, const char* str, int n_rows) \
+    { \
+        return parse_rows_of(arr, str, n_rows, INT, FRAC); \
     }
+DEFINE_PARSE_ROWS(2, 3)
+DEFINE_PARSE_ROWS(3, 2)
+DEFINE_PARSE_ROWS(4, 1)
+DEFINE_PARSE_ROWS(3, 3)
+
+// Parser for any other format, reads the digits from format
+static int parse_rows_generic(points_t arr, const char* str, int n_rows)
+{
+    return parse_rows_of(arr, str, n_rows, format.int_digits, format.frac_digits);
 }
 
-// Function to parse a string containing multiple points
-void parse_points(int16_t* arr, char* const str, int n_rows)
+// Function to pick the parser for the digits of fmt
+parse_rows_t select_parse_rows(const cell_format_t* fmt)
 {
-    int16_t *coord;
-    char *coord_str;
-    for (coord = arr, coord_str = str;
-         coord != arr + 3 * n_rows; // 3*nmbpts;
-         ++coord, coord_str += 8)
-        parse_coord(coord, coord_str);
+    static const struct {
+        int int_digits;
+        int frac_digits;
+        parse_rows_t parse;
+    } specialized[] = {
+        {2, 3, parse_rows_2_3},
+        {3, 2, parse_rows_3_2},
+        {4, 1, parse_rows_4_1},
+        {3, 3, parse_rows_3_3},
+    };
+    for (size_t i = 0; i < sizeof(specialized) / sizeof(specialized[0]); i++)
+        if (specialized[i].int_digits == fmt->int_digits && specialized[i].frac_digits == fmt->frac_digits)
+            return specialized[i].parse;
+    return parse_rows_generic;
 }
 
-// Function to calculate the distance between two points in 3D space
-static inline 
-int distances_3d(int16_t* vec1, int16_t* vec2)
+// Function to parse a string containing multiple points. Returns the largest
+// absolute coordinate in units.
+int parse_points(points_t arr, char* const str, int n_rows, bool parallel)
 {
-    float dx = (float)(vec1[0] - vec2[0]);
-    float dy = (float)(vec1[1] - vec2[1]);
-    float dz = (float)(vec1[2] - vec2[2]);
-    
-    // Calculates distance and converts back to int (truncating to 2 decimal places)
-    return (int)(sqrtf(dx * dx + dy * dy + dz * dz) * 0.1f);
+    // Rows have a fixed width, so every thread can parse its own share
+    int max_abs = 0;
+    #pragma omp parallel if(parallel && n_rows > 4096) reduction(max:max_abs)
+    {
+        int t = omp_get_thread_num(), n_threads = omp_get_num_threads();
+        int first = (int)((long) n_rows * t / n_threads);
+        int last = (int)((long) n_rows * (t + 1) / n_threads);
+        max_abs = parse_rows(points_at(arr, first), str + (size_t) first * row_size, last - first);
+    }
+    return max_abs;
+}
+
+// Function to hash one coordinate array, continuing from hash
+static uint64_t cellbin_hash(uint64_t hash, const int16_t* arr, long n)
+{
+    // FNV-1a over the 16-bit values
+    for (long i = 0; i < n; i++){
+        hash ^= (uint16_t) arr[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to combine the hashes of the x, y and z arrays into the cache checksum
+static uint64_t cellbin_checksum(const uint64_t hash[3])
+{
+    return hash[0] ^ (hash[1] << 21 | hash[1] >> 43) ^ (hash[2] << 42 | hash[2] >> 22);
+}
+
+// Function to map the binary cache at path if it was written for the file
+// described by st. Returns false if there is no valid cache.
+static bool cellbin_map(cells_input_t* in, const char* path, const struct stat* st)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    cellbin_header_t header;
+    struct stat bin_st;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 fstat(fd, &bin_st) == 0 &&
+                 memcmp(header.magic, cellbin_magic, sizeof(cellbin_magic)) == 0 &&
+                 header.int_digits == (uint32_t) format.int_digits &&
+                 header.frac_digits == (uint32_t) format.frac_digits &&
+                 header.max_coord <= (uint64_t) format.max_coord &&
+                 header.source_inode == (uint64_t) st->st_ino &&
+                 header.source_size == (uint64_t) st->st_size &&
+                 header.source_mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+                 header.source_mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+                 (uint64_t) bin_st.st_size == sizeof(header) + header.rows * cols * sizeof(int16_t);
+    if (!valid || header.rows == 0){
+        close(fd);
+        return false;
+    }
+
+    in->bin_map_size = bin_st.st_size;
+    in->bin_map = mmap(NULL, in->bin_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (in->bin_map == MAP_FAILED){
+        in->bin_map = NULL;
+        return false;
+    }
+
+    int16_t* arrays = (int16_t*)((char*) in->bin_map + sizeof(header));
+    in->bin_points = (points_t){arrays, arrays + header.rows, arrays + 2 * header.rows};
+
+    // Reject a cache that was modified or truncated behind our back
+    uint64_t hash[3];
+    for (int c = 0; c < cols; c++)
+        hash[c] = cellbin_hash(14695981039346656037ULL, arrays + c * header.rows, header.rows);
+    if (cellbin_checksum(hash) != header.checksum){
+        fprintf(stderr, "ignoring %s, checksum mismatch\n", path);
+        munmap(in->bin_map, in->bin_map_size);
+        in->bin_map = NULL;
+        return false;
+    }
+    in->bin_header = header;
+    return true;
+}
+
+// Function to start writing the binary cache for the file described by st.
+// The arrays are filled by cellbin_write as the rows are parsed in order.
+static void cellbin_create(cells_input_t* in, const char* path, const struct stat* st, uint32_t rows)
+{
+    snprintf(in->bin_path, sizeof(in->bin_path), "%s.tmp", path);
+    in->bin_fd = open(in->bin_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in->bin_fd == -1)
+        return; // no cache, e.g. in a read-only directory
+
+    memcpy(in->bin_header.magic, cellbin_magic, sizeof(cellbin_magic));
+    in->bin_header.rows = rows;
+    in->bin_header.int_digits = format.int_digits;
+    in->bin_header.frac_digits = format.frac_digits;
+    in->bin_header.max_coord = format.max_coord;
+    in->bin_header.source_inode = st->st_ino;
+    in->bin_header.source_size = st->st_size;
+    in->bin_header.source_mtime_sec = st->st_mtim.tv_sec;
+    in->bin_header.source_mtime_nsec = st->st_mtim.tv_nsec;
+    for (int c = 0; c < cols; c++)
+        in->bin_hash[c] = 14695981039346656037ULL;
+    in->bin_next_row = 0;
+}
+
+// Function to add freshly parsed rows to the binary cache being written
+static void cellbin_write(cells_input_t* in, long first, int n_rows, points_t points)
+{
+    // Only the first, in-order pass over the file feeds the cache
+    if (in->bin_fd == -1 || first != in->bin_next_row)
+        return;
+
+    const int16_t* arrays[3] = {points.x, points.y, points.z};
+    for (int c = 0; c < cols; c++){
+        off_t offset = sizeof(cellbin_header_t) + ((off_t) c * in->bin_header.rows + first) * sizeof(int16_t);
+        if (pwrite(in->bin_fd, arrays[c], n_rows * sizeof(int16_t), offset) != (ssize_t)(n_rows * sizeof(int16_t))){
+            close(in->bin_fd);
+            unlink(in->bin_path);
+            in->bin_fd = -1;
+            return;
+        }
+        in->bin_hash[c] = cellbin_hash(in->bin_hash[c], arrays[c], n_rows);
+    }
+    in->bin_next_row += n_rows;
+}
+
+// Function to finish the binary cache, it is only published once complete
+static void cellbin_finish(cells_input_t* in)
+{
+    if (in->bin_fd == -1)
+        return;
+
+    bool complete = (uint64_t) in->bin_next_row == in->bin_header.rows;
+    if (complete){
+        in->bin_header.checksum = cellbin_checksum(in->bin_hash);
+        complete = pwrite(in->bin_fd, &in->bin_header, sizeof(cellbin_header_t), 0) == sizeof(cellbin_header_t);
+    }
+    close(in->bin_fd);
+    in->bin_fd = -1;
+
+    // Drop the ".tmp" suffix to publish the cache
+    char final_path[sizeof(in->bin_path)];
+    snprintf(final_path, sizeof(final_path), "%s", in->bin_path);
+    final_path[strlen(final_path) - 4] = 0;
+    if (!complete || rename(in->bin_path, final_path) != 0)
+        unlink(in->bin_path);
+}
+
+// Function to open the cells file and count its rows. If use_cache is set a
+// valid binary cache (path.cellbin) is mapped instead, or, with write_cache,
+// one is written while the rows are parsed. With use_mmap the text file is
+// mapped once, otherwise input_rows reads the requested rows into a heap buffer.
+int input_open(cells_input_t* in, const char* path, bool use_mmap, bool use_cache, bool write_cache,
+               uint32_t* rows)
+{
+    in->fp = NULL;
+    in->buffer = NULL;
+    in->buffer_rows = 0;
+    in->map = NULL;
+    in->bin_map = NULL;
+    in->bin_fd = -1;
+    in->parallel_parse = true;
+    mtx_init(&in->lock, mtx_plain);
+
+    struct stat st;
+    if (stat(path, &st) == -1){
+        perror("Error opening file");
+        mtx_destroy(&in->lock);
+        return 1;
+    }
+    in->source_st = st;
+
+    char bin_path[sizeof(in->bin_path) - 4];
+    snprintf(bin_path, sizeof(bin_path), "%s.cellbin", path);
+    if (use_cache && cellbin_map(in, bin_path, &st)){
+        *rows = in->bin_header.rows;
+        return 0;
+    }
+
+    if (use_mmap){
+        int fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) == -1){
+            perror("Error opening file");
+            if (fd != -1)
+                close(fd);
+            mtx_destroy(&in->lock);
+            return 1;
+        }
+        in->map_size = st.st_size;
+        *rows = in->map_size / row_size;
+        if (in->map_size > 0){
+            in->map = (char*) mmap(NULL, in->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (in->map == MAP_FAILED){
+                perror("Error mapping file");
+                close(fd);
+                mtx_destroy(&in->lock);
+                return 1;
+            }
+            // Every later block is visited once per earlier block, so keep the whole
+            // file resident instead of reading ahead and dropping it
+            madvise(in->map, in->map_size, MADV_WILLNEED);
+        }
+        close(fd);
+        if (use_cache && write_cache && *rows > 0)
+            cellbin_create(in, bin_path, &st, *rows);
+        return 0;
+    }
+
+    in->fp = fopen(path, "r");
+    if (in->fp == NULL) {
+        perror("Error opening file");
+        mtx_destroy(&in->lock);
+        return 1;
+    }
+    fseek(in->fp, 0L, SEEK_END);
+    *rows = ftell(in->fp) / row_size;
+    if (use_cache && write_cache && *rows > 0)
+        cellbin_create(in, bin_path, &st, *rows);
+    return 0;
+}
+
+// Function to get the text of n_rows rows starting at row first
+char* input_rows(cells_input_t* in, long first, int n_rows)
+{
+    if (in->map != NULL)
+        return in->map + first * row_size;
+
+    if (n_rows > in->buffer_rows){
+        free(in->buffer);
+        in->buffer = (char*) malloc((size_t) n_rows * row_size);
+        in->buffer_rows = n_rows;
+    }
+    fseek(in->fp, first * row_size, SEEK_SET); // Finds starting point of reading
+    fread((void*) in->buffer, sizeof(char), (size_t) n_rows * row_size, in->fp); // Reads a certain amount of rows
+    return in->buffer;
+}
+
+// Function to stop the run if a parsed coordinate is outside the range of the
+// format, as it would be binned past the end of the histogram. The binary cache
+// being written is dropped, so such points never reach it.
+static void input_check_range(cells_input_t* in, int max_abs)
+{
+    if (max_abs <= format.max_coord)
+        return;
+    fprintf(stderr, "Coordinate %.*f is outside the range %.*f of the format, give a wider RANGE with -f\n",
+            format.frac_digits, max_abs / pow(10, format.frac_digits),
+            format.frac_digits, format.max_coord / pow(10, format.frac_digits));
+    if (in->bin_fd != -1){
+        close(in->bin_fd);
+        unlink(in->bin_path);
+    }
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+    exit(1);
+}
+
+// Function to get n_rows points starting at row first. Parsed rows are stored
+// in dst; rows from the binary cache are returned in place.
+points_t input_points(cells_input_t* in, long first, int n_rows, points_t dst)
+{
+    if (in->bin_map != NULL)
+        return points_at(in->bin_points, first);
+
+    if (in->map != NULL){
+        input_check_range(in, parse_points(dst, input_rows(in, first, n_rows), n_rows, in->parallel_parse));
+        cellbin_write(in, first, n_rows, dst);
+        return dst;
+    }
+
+    mtx_lock(&in->lock);
+    input_check_range(in, parse_points(dst, input_rows(in, first, n_rows), n_rows, in->parallel_parse));
+    cellbin_write(in, first, n_rows, dst);
+    mtx_unlock(&in->lock);
+    return dst;
+}
+
+// Function to complete a binary cache that is being written by parsing the
+// remaining rows of [0, rows) in order, in chunks of block_size rows with
+// buffer as scratch. The finished cache is then mapped, so that the blocks
+// are served from it in any order.
+void input_prepare(cells_input_t* in, long rows, int block_size, points_t buffer)
+{
+    if (in->bin_fd == -1)
+        return;
+    for (long first = in->bin_next_row; first < rows; first += block_size)
+        input_points(in, first, rows - first < block_size ? (int)(rows - first) : block_size, buffer);
+
+    char path[sizeof(in->bin_path)];
+    snprintf(path, sizeof(path), "%s", in->bin_path);
+    path[strlen(path) - 4] = 0; // without ".tmp"
+    cellbin_finish(in);
+    cellbin_map(in, path, &in->source_st);
+}
+
+void input_close(cells_input_t* in)
+{
+    cellbin_finish(in);
+    mtx_destroy(&in->lock);
+    if (in->bin_map != NULL)
+        munmap(in->bin_map, in->bin_map_size);
+    if (in->map != NULL)
+        munmap(in->map, in->map_size);
+    if (in->fp != NULL)
+        fclose(in->fp);
+    free(in->buffer);
+}
+
+// Function to split rows [first, last) into blocks of at most block_size rows,
+// appended to the layout after its first n_blocks blocks. Returns the new number of blocks.
+int layout_blocks(long first, long last, int block_size, long* first_of, int* rows_of, int n_blocks)
+{
+    for (long row = first; row < last; row += block_size, n_blocks++){
+        first_of[n_blocks] = row;
+        rows_of[n_blocks] = last - row < block_size ? (int)(last - row) : block_size;
+    }
+    return n_blocks;
+}
+
+static int compare_ints(const void* a, const void* b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+// Function to pick the block rows k < n_rows that process rank of n_ranks
+// counts. Row k pairs block k with itself and every later block, so its work
+// falls linearly with k and row k is folded together with row n_rows-1-k into
+// units of equal work, dealt out round robin. Returns the number of rows
+// written to ks in ascending order.
+int assign_block_rows(int n_rows, int rank, int n_ranks, int* ks)
+{
+    int n_ks = 0;
+    for (int k = rank; k < (n_rows + 1) / 2; k += n_ranks){
+        ks[n_ks++] = k;
+        if (n_rows - 1 - k != k)
+            ks[n_ks++] = n_rows - 1 - k;
+    }
+    qsort(ks, n_ks, sizeof(int), compare_ints);
+    return n_ks;
+}
+
+// Function to get the first block paired with block row k
+static inline
+int layout_first_cross(const block_layout_t* layout, int k)
+{
+    return layout->cross_from < 0 ? k + 1 : layout->cross_from;
+}
+
+// Function to allocate the block caches of n_threads threads, n_blocks blocks
+// each. The arrays of a block are only allocated once it needs a copy.
+block_cache_t* block_caches_create(int n_threads, int n_blocks)
+{
+    block_cache_t* caches = (block_cache_t*) malloc(sizeof(block_cache_t) * n_threads);
+    for (int t = 0; t < n_threads; t++){
+        caches[t].blocks = (cached_block_t*) calloc(n_blocks, sizeof(cached_block_t));
+        for (int i = 0; i < n_blocks; i++)
+            caches[t].blocks[i].block = -1;
+        caches[t].n_blocks = n_blocks;
+        caches[t].uses = 0;
+        caches[t].load_time = 0.;
+    }
+    return caches;
+}
+
+// Function to get block b on the calling thread. A block that is not cached
+// replaces the least recently used one, so the other block of the current
+// pair stays valid as long as there are at least two.
+const cached_block_t* block_cache_get(block_cache_t* cache, const block_layout_t* layout, int b)
+{
+    cached_block_t* victim = cache->blocks;
+    cache->uses++;
+    for (int i = 0; i < cache->n_blocks; i++){
+        cached_block_t* cb = cache->blocks + i;
+        if (cb->block == b){
+            cb->last_use = cache->uses;
+            return cb;
+        }
+        if (cb->last_use < victim->last_use)
+            victim = cb;
+    }
+
+    double start = omp_get_wtime();
+    int n = layout->rows_of[b], size = layout->block_size;
+    if (layout->input_of[b]->bin_map == NULL && victim->entries == NULL)
+        victim->entries = (int16_t*) malloc(sizeof(int16_t) * size * cols);
+    points_t dst = {NULL, NULL, NULL};
+    if (victim->entries != NULL)
+        dst = (points_t){victim->entries, victim->entries + size, victim->entries + 2 * size};
+    victim->points = input_points(layout->input_of[b], layout->first_of[b], n, dst);
+    victim->block = b;
+    victim->last_use = cache->uses;
+    cache->load_time += omp_get_wtime() - start;
+    return victim;
+}
+
+void block_caches_free(block_cache_t* caches, int n_threads)
+{
+    for (int t = 0; t < n_threads; t++){
+        for (int i = 0; i < caches[t].n_blocks; i++)
+            free(caches[t].blocks[i].entries);
+        free(caches[t].blocks);
+    }
+    free(caches);
+}
+
+// Function to fingerprint the points of rows [0, rows) in chunks of block_size
+// rows, using buffer as scratch. The fingerprint of rows [0, mid_rows) is
+// stored in at_mid and that of all rows in at_end. As it walks the file in
+// order it also completes a binary cache that is being written.
+void fingerprint_points(cells_input_t* in, long rows, long mid_rows, int block_size, points_t buffer,
+                        uint64_t* at_mid, uint64_t* at_end)
+{
+    uint64_t hash[3];
+    for (int c = 0; c < cols; c++)
+        hash[c] = 14695981039346656037ULL;
+    *at_mid = cellbin_checksum(hash);
+
+    for (long first = 0; first < rows; ){
+        // Stop the chunk at mid_rows so the fingerprint can be taken there
+        long last = first + block_size < rows ? first + block_size : rows;
+        if (first < mid_rows && last > mid_rows)
+            last = mid_rows;
+        points_t p = input_points(in, first, (int)(last - first), buffer);
+        hash[0] = cellbin_hash(hash[0], p.x, last - first);
+        hash[1] = cellbin_hash(hash[1], p.y, last - first);
+        hash[2] = cellbin_hash(hash[2], p.z, last - first);
+        first = last;
+        if (first == mid_rows)
+            *at_mid = cellbin_checksum(hash);
+    }
+    *at_end = cellbin_checksum(hash);
+}
+
+// Function to read the histogram state at path into header and distances.
+// Returns false if there is no usable state.
+bool state_load(const char* path, hist_state_header_t* header, size_t* distances)
+{
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+
+    uint64_t counts[max_dist];
+    bool valid = fread(header, sizeof(hist_state_header_t), 1, fp) == 1 &&
+                 memcmp(header->magic, state_magic, sizeof(state_magic)) == 0 &&
+                 header->n_bins == (uint64_t) max_dist &&
+                 header->bin_units == (uint64_t) format.bin_units &&
+                 header->exact == (uint64_t) exact_binning &&
+                 fread(counts, sizeof(uint64_t), max_dist, fp) == (size_t) max_dist;
+    fclose(fp);
+    if (!valid){
+        fprintf(stderr, "ignoring %s, not a histogram state of this format and binning\n", path);
+        return false;
+    }
+    for (int i = 0; i < max_dist; i++)
+        distances[i] = counts[i];
+    return true;
+}
+
+// Function to save the histogram of the first rows rows to path
+void state_save(const char* path, uint64_t rows, uint64_t fingerprint, const size_t* distances)
+{
+    hist_state_header_t header;
+    memcpy(header.magic, state_magic, sizeof(state_magic));
+    header.rows = rows;
+    header.fingerprint = fingerprint;
+    header.n_bins = max_dist;
+    header.bin_units = format.bin_units;
+    header.exact = exact_binning;
+    uint64_t counts[max_dist];
+    for (int i = 0; i < max_dist; i++)
+        counts[i] = distances[i];
+
+    // Write next to the old state and swap it in only once complete
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL){
+        perror("Error writing state");
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(counts, sizeof(uint64_t), max_dist, fp) == (size_t) max_dist;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0){
+        perror("Error writing state");
+        unlink(tmp_path);
+    }
+}
+
+// Function to get the points starting at offset
+static inline
+points_t points_at(points_t p, int offset)
+{
+    return (points_t){p.x + offset, p.y + offset, p.z + offset};
+}
+
+// Function to allocate one histogram per thread, each padded to whole cache lines
+thread_hist_t* thread_hists_create(int n_threads, int n_lanes)
+{
+    thread_hist_t* hists = (thread_hist_t*) aligned_alloc(64, sizeof(thread_hist_t) * n_threads);
+    size_t sub_bytes = sizeof(uint32_t) * n_lanes * lane_stride;
+    size_t spill_bytes = sizeof(uint64_t) * lane_stride;
+    for (int t = 0; t < n_threads; t++){
+        char* mem = (char*) aligned_alloc(64, sub_bytes + spill_bytes);
+        memset(mem, 0, sub_bytes + spill_bytes);
+        hists[t].sub = (uint32_t*) mem;
+        hists[t].spill = (uint64_t*)(mem + sub_bytes);
+        hists[t].pending = 0;
+        hists[t].n_lanes = n_lanes;
+    }
+    return hists;
+}
+
+// Function to move the lane sub-histograms into the 64-bit totals
+void thread_hist_spill(thread_hist_t* h)
+{
+    for (int l = 0; l < h->n_lanes; l++){
+        uint32_t* sub = h->sub + l * lane_stride;
+        for (int i = 0; i < max_dist; i++){
+            h->spill[i] += sub[i];
+            sub[i] = 0;
+        }
+    }
+    h->pending = 0;
+}
+
+// Function to add up the histograms of all threads once at the end of the run.
+// Every thread sums a range of bins over all histograms.
+void thread_hists_merge(thread_hist_t* hists, int n_threads, size_t* distances)
+{
+    #pragma omp parallel for
+    for (int t = 0; t < n_threads; t++)
+        thread_hist_spill(hists + t);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < max_dist; i++)
+        for (int t = 0; t < n_threads; t++)
+            distances[i] += hists[t].spill[i];
+}
+
+void thread_hists_free(thread_hist_t* hists, int n_threads)
+{
+    for (int t = 0; t < n_threads; t++)
+        free(hists[t].sub);
+    free(hists);
+}
+
+// Function to count the distances between point a.x[0] and the n points of b
+static inline
+void count_row(thread_hist_t* h, points_t a, points_t b, int n)
+{
+    // Spill before a single counter could overflow
+    if (h->pending + n > UINT32_MAX)
+        thread_hist_spill(h);
+    row_kernel(a.x[0], a.y[0], a.z[0], b.x, b.y, b.z, n, h->sub);
+    h->pending += n;
+}
+
+// Function to count the pairs within a block of n points whose first point
+// is in rows [r0, r1). Row i has n-1-i pairs, so it is folded together with
+// row n-2-i into one unit of n pairs and equal ranges of units are equal work.
+void count_block_self(points_t p, int n, int r0, int r1, thread_hist_t* h)
+{
+    for (int i = r0; i < r1; i++){
+        int mirror = n - 2 - i;
+        count_row(h, points_at(p, i), points_at(p, i + 1), n - i - 1);
+        if (mirror > i)
+            count_row(h, points_at(p, mirror), points_at(p, mirror + 1), n - mirror - 1);
+    }
+}
+
+// Function to pick the tile size from the data cache sizes. A cross tile fills
+// half of L1 so the other half keeps the hot histogram lines; each own row of
+// the tile then reuses it straight from L1. The rows are capped so that a
+// thread working on the tile keeps its sub-histograms in L2.
+tile_t tile_autotune(int own_size)
+{
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l1 <= 0)
+        l1 = 32 * 1024;
+    if (l2 <= 0)
+        l2 = 1024 * 1024;
+
+    tile_t tile;
+    tile.cols = (int)(l1 / 2 / (cols * sizeof(int16_t))) / MAX_LANES * MAX_LANES;
+    if (tile.cols < 4 * MAX_LANES)
+        tile.cols = 4 * MAX_LANES;
+
+    long hist_bytes = (long) MAX_LANES * lane_stride * sizeof(uint32_t);
+    long spare = l2 - hist_bytes - (long) tile.cols * cols * sizeof(int16_t);
+    tile.rows = spare > 0 ? (int)(spare / (cols * sizeof(int16_t))) : 16;
+    if (tile.rows > own_size)
+        tile.rows = own_size;
+    if (tile.rows > 1024)
+        tile.rows = 1024;
+    if (tile.rows < 16)
+        tile.rows = 16;
+    return tile;
+}
+
+// Function to count all pairs between own rows [r0, r1) and a cross block, tile by tile
+void count_block_cross(points_t own, int r0, int r1, points_t cross, int cross_size,
+                       tile_t tile, thread_hist_t* h)
+{
+    for (int t0 = r0; t0 < r1; t0 += tile.rows){
+        int t1 = t0 + tile.rows < r1 ? t0 + tile.rows : r1;
+        for (int c0 = 0; c0 < cross_size; c0 += tile.cols){
+            int n = c0 + tile.cols < cross_size ? tile.cols : cross_size - c0;
+            for (int iown = t0; iown < t1; iown++){
+                // Calculate distances and update the distances array
+                count_row(h, points_at(own, iown), points_at(cross, c0), n);
+            }
+        }
+    }
+}
+
+// Function to count part of n_parts of the pairs between blocks k and ic, or
+// within block k if ic == k, on the calling thread. The parts split the rows
+// of block k.
+void count_block_pair(const block_layout_t* layout, block_cache_t* caches, thread_hist_t* hists, tile_t tile,
+                      int k, int ic, int part, int n_parts)
+{
+    int t = omp_get_thread_num();
+    thread_hist_t* h = hists + t;
+    const cached_block_t* own = block_cache_get(caches + t, layout, k);
+    int own_size = layout->rows_of[k];
+    int n_units = ic == k ? own_size / 2 : own_size;
+    int u0 = (int)((long) n_units * part / n_parts);
+    int u1 = (int)((long) n_units * (part + 1) / n_parts);
+
+    if (ic == k){
+        count_block_self(own->points, own_size, u0, u1, h);
+        return;
+    }
+    const cached_block_t* cross = block_cache_get(caches + t, layout, ic);
+    count_block_cross(own->points, u0, u1, cross->points, layout->rows_of[ic], tile, h);
 }
 
 int main(int argc, char* argv[]){
+    // Every MPI rank counts a share of the block rows, without MPI there is a single rank
+    int mpi_rank = 0, nmb_mpi_proc = 1;
+#ifdef USE_MPI
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &nmb_mpi_proc);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+#endif
+
     // Determine the number of threads from input arg
-    int opt, n_threads;
-    while((opt = getopt(argc, argv, "t:")) != -1){
+    int opt, n_threads = omp_get_max_threads();
+    bool use_mmap = false, use_cache = true, verbose = false;
+    int n_cached = 2;
+    tile_t tile = {0, 0};
+    const char* kernel_name = NULL;
+    const char* state_path = NULL;
+    const char* format_desc = CELL_FORMAT_DEFAULT;
+    const char* path_a = "cells";
+    const char* path_b = NULL;
+    enum { opt_tile = 256 };
+    static const struct option long_options[] = {
+        {"tile", required_argument, NULL, opt_tile},
+        {NULL, 0, NULL, 0}
+    };
+    while((opt = getopt_long(argc, argv, "t:k:emnp:vs:f:a:b:", long_options, NULL)) != -1){
         switch(opt){
             case 't':
                 n_threads = atoi(optarg);
                 break;
+            case 'k':
+                // Force a distance kernel instead of detecting the widest one
+                kernel_name = optarg;
+                break;
+            case 'e':
+                // Bin the exact integer squared distances instead of rounding through sqrtf
+                exact_binning = true;
+                break;
+            case 'm':
+                // Map the file once and parse the blocks straight from the mapping
+                use_mmap = true;
+                break;
+            case 'n':
+                // Neither read nor write the binary cache cells.cellbin
+                use_cache = false;
+                break;
+            case 'p':
+                // Number of blocks every thread keeps loaded, at least 2
+                n_cached = atoi(optarg) > 2 ? atoi(optarg) : 2;
+                break;
+            case 'v':
+                // Print a timing summary to stderr
+                verbose = true;
+                break;
+            case opt_tile:
+                // Tile of the cross loop as ROWSxCOLS or N for N x N, instead of the autotuned one
+                if (sscanf(optarg, "%dx%d", &tile.rows, &tile.cols) == 1)
+                    tile.cols = tile.rows;
+                break;
+            case 's':
+                // Keep the histogram in this state file and only count rows appended since
+                state_path = optarg;
+                break;
+            case 'f':
+                // Format of the rows and binning as INT.FRAC[,BIN[,RANGE]], see cell_format.h
+                format_desc = optarg;
+                break;
+            case 'a':
+                // Read the points from this file instead of cells
+                path_a = optarg;
+                break;
+            case 'b':
+                // Count only the pairs between the points of -a and of this file
+                path_b = optarg;
+                break;
             default:
                 break;
         }
     }
+    if (path_b != NULL && state_path != NULL){
+        fprintf(stderr, "A state file (-s) can not be used with a second file (-b)\n");
+#ifdef USE_MPI
+        MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+        return 1;
+    }
+    double start_time = omp_get_wtime();
     omp_set_num_threads(n_threads);
 
-    // Open the file
-    FILE *fp = fopen("cells", "r");
-    if (fp == NULL) {
-        perror("Error opening file");
+    // Set up the parser and bins for the format
+    if (cell_format_parse(format_desc, &format) != 0){
+#ifdef USE_MPI
+        MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
         return 1;
     }
+    if (exact_binning && 12. * format.max_coord * format.max_coord >= INT32_MAX){
+        fprintf(stderr, "Exact binning needs squared distances below 2^31, the range of %s is too wide\n",
+                format_desc);
+#ifdef USE_MPI
+        MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+        return 1;
+    }
+    parse_rows = select_parse_rows(&format);
+    row_size = cell_format_row_size(&format);
+    max_dist = cell_format_bins(&format);
+    distance_kernels_init(max_dist, format.bin_units);
+    if (exact_binning)
+        exact_bins_init();
+    row_kernel = select_row_kernel(kernel_name, exact_binning, &row_kernel_lanes);
 
-    // Determine size of the file and extract row size and block size from that
-    fseek(fp, 0L, SEEK_END);
-    uint32_t rows = ftell(fp)/row_size;
-    fclose(fp);
-    const int block_size = (int) fmin(rows * 0.01, 100000.f); // size of one block
-    const int max_read_size = block_size * 2; // maximum amount of located memory
-    const int iter = (rows - 1) / block_size + 1;
-    const int last_block_size = rows - block_size * (iter - 1);
+    // Open the files and determine their number of rows. Only rank 0 writes the
+    // binary caches, in one pass over each file before the counting starts.
+    cells_input_t input, input_b;
+    uint32_t rows, rows_b = 0;
+    if (input_open(&input, path_a, use_mmap, use_cache, mpi_rank == 0, &rows) != 0 ||
+        (path_b != NULL && input_open(&input_b, path_b, use_mmap, use_cache, mpi_rank == 0, &rows_b) != 0)){
+#ifdef USE_MPI
+        MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+        return 1;
+    }
+
+    // Extract block size from the number of rows, at least one row for files under 100 rows
+    const int block_size = (int) fmax(fmin((rows > rows_b ? rows : rows_b) * 0.01, 100000.f), 1.); // size of one block
+    if (tile.rows <= 0 || tile.cols <= 0)
+        tile = tile_autotune(block_size);
 
-    // Declare arrays
-    int16_t* asentries = (int16_t*)malloc(sizeof(int16_t) * max_read_size * cols);
-    int16_t** cells = (int16_t**)malloc(sizeof(int16_t*) * max_read_size);
-    for (size_t i = 0, j = 0; i < max_read_size; i++, j += cols)
-        cells[i] = asentries + j;
+    // Scratch block for the passes over the files in order
+    int16_t* scratch_entries = (int16_t*)malloc(sizeof(int16_t) * block_size * cols);
+    points_t scratch = {scratch_entries, scratch_entries + block_size, scratch_entries + 2 * block_size};
 
     size_t distances[max_dist]; 
-    for (int16_t i = 0; i < max_dist; i++){
+    for (int i = 0; i < max_dist; i++){
         distances[i] = 0;
     }
-    fp = fopen("cells", "r");
-    char str_to_parse[block_size * row_size];
-    int bz, mxrdsz;
-    for (int k = 0; k < iter; k++){   
-        bz = k != iter - 1 ? block_size : last_block_size;
-
-        fseek(fp, bz * row_size * k, SEEK_SET); // Finds starting point of reading
-        fread((void*) str_to_parse, sizeof(char), bz * row_size, fp); // Reads a certain amount of rows
-        parse_points(cells[0], str_to_parse, bz);
 
-        for (int i = 0; i < bz - 1; i++){
-            for (int j = i + 1; j < bz; j++){
-                // Calculate distances and update the distances array
-                distances[distances_3d(cells[i], cells[j])]++;
+    // With a state file the histogram of the first old_rows rows is loaded on
+    // rank 0 if those rows are unchanged, and only pairs with a newer row are counted
+    long old_rows = 0;
+    uint64_t fingerprint = 0;
+    if (state_path != NULL){
+        if (mpi_rank == 0){
+            hist_state_header_t header;
+            uint64_t old_fingerprint;
+            bool loaded = state_load(state_path, &header, distances);
+            long mid_rows = loaded && header.rows <= rows ? (long) header.rows : 0;
+            fingerprint_points(&input, rows, mid_rows, block_size, scratch, &old_fingerprint, &fingerprint);
+            if (loaded && header.rows <= rows && old_fingerprint == header.fingerprint)
+                old_rows = header.rows;
+            else if (loaded){
+                fprintf(stderr, "%s does not match the start of %s, counting all rows\n", state_path, path_a);
+                for (int i = 0; i < max_dist; i++)
+                    distances[i] = 0;
             }
         }
-        
-        // All the cross read ins and distance calculations
-        for (int ic = k + 1; ic < iter; ic++){
-            if (ic != iter - 1){
-                bz = block_size;
-                mxrdsz = max_read_size;
-            }
-            else{
-                bz = last_block_size;
-                mxrdsz = block_size + last_block_size;
-            }
+#ifdef USE_MPI
+        MPI_Bcast(&old_rows, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+#endif
+    }
+
+    // Lay out the new rows as the first blocks, followed by the old rows. Only
+    // the new blocks are own blocks, so every pair with a new row is counted once.
+    // With a second file its blocks follow those of the first and are the cross
+    // blocks of every own block, which then has no pairs with its own file.
+    int max_blocks = rows / block_size + rows_b / block_size + 4;
+    long* first_of = (long*)malloc(sizeof(long) * max_blocks);
+    int* rows_of = (int*)malloc(sizeof(int) * max_blocks);
+    const int n_new_blocks = layout_blocks(old_rows, rows, block_size, first_of, rows_of, 0);
+    const int n_blocks_a = layout_blocks(0, old_rows, block_size, first_of, rows_of, n_new_blocks);
+    const int iter = layout_blocks(0, rows_b, block_size, first_of, rows_of, n_blocks_a);
+    const int cross_from = path_b != NULL ? n_blocks_a : -1;
+    cells_input_t** input_of = (cells_input_t**)malloc(sizeof(cells_input_t*) * max_blocks);
+    for (int b = 0; b < iter; b++)
+        input_of[b] = b < n_blocks_a ? &input : &input_b;
+
+    // Block rows k counted by this rank
+    int* ks = (int*)malloc(sizeof(int) * iter);
+    int n_ks = assign_block_rows(n_new_blocks, mpi_rank, nmb_mpi_proc, ks);
+    block_layout_t layout = {input_of, first_of, rows_of, iter, block_size, cross_from};
+
+    // Complete the binary caches first, the blocks are then loaded in any order
+    input_prepare(&input, rows, block_size, scratch);
+    if (path_b != NULL)
+        input_prepare(&input_b, rows_b, block_size, scratch);
+    free(scratch_entries);
+    // Every block is loaded by a single thread
+    input.parallel_parse = false;
+    if (path_b != NULL)
+        input_b.parallel_parse = false;
 
-            fseek(fp, bz * row_size * ic, SEEK_SET); // Finds starting point of reading
-            fread((void*) str_to_parse, sizeof(char), bz * row_size, fp); // Reads a certain amount of rows
-            parse_points(cells[block_size], str_to_parse, bz);
+    // Every block pair is split into n_parts tasks, enough to keep all threads
+    // busy until the end. Threads take whichever tasks are left and keep the
+    // blocks of their recent tasks, so there is no barrier between block pairs.
+    long n_pairs = 0;
+    for (int ik = 0; ik < n_ks; ik++)
+        n_pairs += (cross_from < 0) + iter - layout_first_cross(&layout, ks[ik]);
+    const int n_parts = n_pairs > 0 && n_pairs < 8L * n_threads ? (int)((8L * n_threads + n_pairs - 1) / n_pairs) : 1;
 
-            #pragma omp parallel for shared(cells) reduction(+:distances[:max_dist])
-            for (int iown = 0; iown < bz; iown++){
-                for (int icross = block_size; icross < mxrdsz; icross++){
-                    // Calculate distances and update the distances array
-                    distances[distances_3d(cells[iown], cells[icross])]++;
-                }
+    // Every thread counts into its own histogram, they are merged once at the end
+    block_cache_t* caches = block_caches_create(n_threads, n_cached);
+    thread_hist_t* hists = thread_hists_create(n_threads, row_kernel_lanes);
+    #pragma omp parallel
+    #pragma omp single
+    for (int ik = 0; ik < n_ks; ik++){
+        int k = ks[ik];
+        // Block row k itself, then its cross blocks
+        for (int ic = cross_from < 0 ? k : cross_from; ic < iter; ic++){
+            for (int part = 0; part < n_parts; part++){
+                #pragma omp task firstprivate(k, ic, part)
+                count_block_pair(&layout, caches, hists, tile, k, ic, part, n_parts);
             }
         }
     }
-    fclose(fp);
+    input_close(&input);
+    if (path_b != NULL)
+        input_close(&input_b);
+    thread_hists_merge(hists, n_threads, distances);
+    thread_hists_free(hists, n_threads);
+    double load_time = 0.;
+    for (int t = 0; t < n_threads; t++)
+        load_time += caches[t].load_time;
+    block_caches_free(caches, n_threads);
 
-    // Print out all the distances and corresponding frequencies (excluding all duplicates)
-    for (int16_t i = 0; i < max_dist; i++){
-        if (distances[i] != 0){
-            if (i < 1000)
-                printf("0%.2f %d \n", i * 0.01f, distances[i]);
-            else
-                printf("%.2f %d \n", i * 0.01f, distances[i]);
-        }
+    if (verbose){
+        double total_time = omp_get_wtime() - start_time;
+        if (mpi_rank == 0)
+            fprintf(stderr, "tile %d x %d\n", tile.rows, tile.cols);
+        fprintf(stderr, "rank %d: total %.3f s, load %.3f s over %d threads, %ld block pairs in %d parts\n",
+                mpi_rank, total_time, load_time, n_threads, n_pairs, n_parts);
+    }
+
+#ifdef USE_MPI
+    // Add up the histograms of all ranks on rank 0
+    _Static_assert(sizeof(size_t) == sizeof(unsigned long), "distances are reduced as MPI_UNSIGNED_LONG");
+    MPI_Reduce(mpi_rank == 0 ? MPI_IN_PLACE : distances, distances, max_dist,
+               MPI_UNSIGNED_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+#endif
+
+    if (state_path != NULL && mpi_rank == 0)
+        state_save(state_path, rows, fingerprint, distances);
+
+    // Print out all the distances and corresponding frequencies (excluding all duplicates),
+    // zero padded like 09.99 by default
+    const float bin_width = cell_format_bin_width(&format);
+    const int print_width = cell_format_print_width(&format);
+    const int decimals = cell_format_decimals(&format);
+    for (int i = 0; i < max_dist && mpi_rank == 0; i++){
+        if (distances[i] != 0)
+            printf("%0*.*f %zu \n", print_width, decimals, i * bin_width, distances[i]);
     }
     
-    free(asentries);
-    free(cells);
+    free(ks);
+    free(first_of);
+    free(rows_of);
+    free(input_of);
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
     return 0;
 }
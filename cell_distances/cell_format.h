@@ -0,0 +1,111 @@
+#ifndef CELL_FORMAT_H
+#define CELL_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Layout of the rows of a cells file and binning of the histogram. A row holds
+// three coordinates [+-]I.F with int_digits digits I and frac_digits digits F,
+// each followed by a space or, for the last one, a newline. Points are stored
+// as int16_t in units of 10^-frac_digits, so max_coord must fit in 16 bits.
+typedef struct {
+    int int_digits;
+    int frac_digits;
+    int bin_units; // width of a histogram bin in coordinate units
+    int max_coord; // largest absolute coordinate in units
+} cell_format_t;
+
+// Descriptor INT.FRAC[,BIN[,RANGE]] of the course data: +dd.ddd coordinates
+// within +-10 and bins of 0.01
+#define CELL_FORMAT_DEFAULT "2.3,0.01,10"
+
+// Function to convert a decimal number to units of 10^-frac_digits. Returns
+// -1 if it is not a whole number of units.
+static long cell_format_units(const char* str, int frac_digits)
+{
+    char* end;
+    double value = strtod(str, &end) * pow(10, frac_digits);
+    long units = lround(value);
+    if (end == str || (*end != 0 && *end != ',') || fabs(value - units) > 1e-6 * (fabs(value) + 1))
+        return -1;
+    return units;
+}
+
+// Function to read a format descriptor INT.FRAC[,BIN[,RANGE]], e.g. "3.2,0.05,250"
+// for +ddd.dd coordinates within +-250 and bins of 0.05. BIN defaults to 0.01
+// (or one unit if that is finer), RANGE to 10^(INT-1), which must then fit
+// in 16 bits. Returns 0 on success.
+static int cell_format_parse(const char* desc, cell_format_t* fmt)
+{
+    int consumed = 0;
+    if (sscanf(desc, "%d.%d%n", &fmt->int_digits, &fmt->frac_digits, &consumed) != 2 ||
+        fmt->int_digits < 1 || fmt->frac_digits < 1 || fmt->int_digits + fmt->frac_digits > 9){
+        fprintf(stderr, "Invalid format %s, expected INT.FRAC[,BIN[,RANGE]] with at most 9 digits\n", desc);
+        return 1;
+    }
+
+    const char* bin = desc[consumed] == ',' ? desc + consumed + 1 : NULL;
+    const char* range = bin != NULL ? strchr(bin, ',') : NULL;
+    long unit_scale = lround(pow(10, fmt->frac_digits));
+
+    long bin_units = bin != NULL ? cell_format_units(bin, fmt->frac_digits)
+                                 : (fmt->frac_digits >= 2 ? unit_scale / 100 : 1);
+    long max_coord = range != NULL ? cell_format_units(range + 1, fmt->frac_digits)
+                                   : lround(pow(10, fmt->int_digits - 1)) * unit_scale;
+    if (range == NULL && max_coord > 32767){
+        fprintf(stderr, "Invalid format %s, the default range %ld does not fit in 16 bits, give a RANGE "
+                        "of at most %g\n", desc, max_coord / unit_scale, 32767. / unit_scale);
+        return 1;
+    }
+    if (bin_units < 1 || max_coord < 1 || max_coord > 32767){
+        fprintf(stderr, "Invalid format %s, the bin width must be a positive multiple of "
+                        "10^-%d and the range must fit in 16 bits\n", desc, fmt->frac_digits);
+        return 1;
+    }
+    fmt->bin_units = (int) bin_units;
+    fmt->max_coord = (int) max_coord;
+    return 0;
+}
+
+// Function to get the number of bytes of one row
+static inline int cell_format_row_size(const cell_format_t* fmt)
+{
+    return 3 * (fmt->int_digits + fmt->frac_digits + 3);
+}
+
+// Function to get the number of histogram bins, the largest distance is 2*sqrt(3)*max_coord
+static inline int cell_format_bins(const cell_format_t* fmt)
+{
+    return (int)(2 * sqrt(3.) * fmt->max_coord / fmt->bin_units) + 1;
+}
+
+// Function to get the width of a bin as printed, e.g. 0.01f
+static inline float cell_format_bin_width(const cell_format_t* fmt)
+{
+    return (float)(fmt->bin_units / pow(10, fmt->frac_digits));
+}
+
+// Function to get the number of decimals needed to print the bin distances
+static inline int cell_format_decimals(const cell_format_t* fmt)
+{
+    int decimals = fmt->frac_digits;
+    for (int units = fmt->bin_units; decimals > 0 && units % 10 == 0; units /= 10)
+        decimals--;
+    return decimals;
+}
+
+// Function to get the width of a printed bin distance. The integer part is
+// zero padded to the digits of the largest distance, "09.99" by default.
+static inline int cell_format_print_width(const cell_format_t* fmt)
+{
+    int decimals = cell_format_decimals(fmt);
+    double max_distance = cell_format_bins(fmt) * (double) cell_format_bin_width(fmt);
+    int digits = 1;
+    for (double d = max_distance; d >= 10; d /= 10)
+        digits++;
+    return digits + (decimals > 0 ? decimals + 1 : 0);
+}
+
+#endif
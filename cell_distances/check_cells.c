@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <omp.h>
+#include "cell_format.h"
+
+// Reference for cell_distances: counts every pair of a cells file by brute
+// force, with its own parser and without blocks or SIMD. Without an
+// output file it prints the histogram in the format of cell_distances,
+// otherwise it compares the output against it and lists differing bins.
+
+// Function prototypes
+int16_t* read_cells(const char*, long*);
+int reference_bin(const int16_t*, const int16_t*, bool);
+int read_histogram(const char*, uint64_t*);
+
+// Format of the rows and binning
+cell_format_t format;
+int max_dist; // number of bins
+
+// Function to read all points of path in units of the format, three per row.
+// Returns NULL if a coordinate is outside the range of the format.
+int16_t* read_cells(const char* path, long* n_rows)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL){
+        perror("Error opening cells file");
+        return NULL;
+    }
+    long capacity = 1024, n = 0;
+    int16_t* points = malloc(sizeof(int16_t) * 3 * capacity);
+    double a, b, c, scale = pow(10, format.frac_digits);
+    while (fscanf(fp, "%lf %lf %lf", &a, &b, &c) == 3){
+        if (n == capacity){
+            capacity *= 2;
+            points = realloc(points, sizeof(int16_t) * 3 * capacity);
+        }
+        long units[3] = {lround(a * scale), lround(b * scale), lround(c * scale)};
+        for (int k = 0; k < 3; k++){
+            if (labs(units[k]) > format.max_coord){
+                fprintf(stderr, "Row %ld of %s is outside the range of the format\n", n + 1, path);
+                fclose(fp);
+                free(points);
+                return NULL;
+            }
+            points[3 * n + k] = (int16_t) units[k];
+        }
+        n++;
+    }
+    fclose(fp);
+    *n_rows = n;
+    return points;
+}
+
+// Function to get the bin of a pair, either rounded through sqrtf like the
+// default of cell_distances or exactly like its -e option
+int reference_bin(const int16_t* p, const int16_t* q, bool exact)
+{
+    if (!exact){
+        float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+        return (int)(sqrtf(dx * dx + dy * dy + dz * dz) * (1.0f / format.bin_units));
+    }
+    int64_t dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+    int64_t d2 = dx * dx + dy * dy + dz * dz;
+    // Largest b with bin_units^2*b*b <= d2
+    int64_t unit2 = (int64_t) format.bin_units * format.bin_units;
+    int64_t bin = (int64_t) sqrt((double) d2 / unit2);
+    while ((bin + 1) * (bin + 1) * unit2 <= d2) bin++;
+    while (bin * bin * unit2 > d2) bin--;
+    return (int) bin;
+}
+
+// Function to read a histogram printed by cell_distances into counts
+int read_histogram(const char* path, uint64_t* counts)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL){
+        perror("Error opening histogram");
+        return 1;
+    }
+    double dist;
+    unsigned long long count;
+    while (fscanf(fp, "%lf %llu", &dist, &count) == 2){
+        long bin = lround(dist / cell_format_bin_width(&format));
+        if (bin < 0 || bin >= max_dist){
+            fprintf(stderr, "Distance %.2f is out of range\n", dist);
+            fclose(fp);
+            return 1;
+        }
+        counts[bin] += count;
+    }
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    bool exact = false;
+    const char* format_desc = CELL_FORMAT_DEFAULT;
+    int opt;
+    while((opt = getopt(argc, argv, "ef:")) != -1){
+        switch(opt){
+            case 'e':
+                // Exact integer bins, to check cell_distances -e
+                exact = true;
+                break;
+            case 'f':
+                // Format of the rows and binning as INT.FRAC[,BIN[,RANGE]], see cell_format.h
+                format_desc = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-e] [-f format] cells [output]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc){
+        fprintf(stderr, "Usage: %s [-e] [-f format] cells [output]\n", argv[0]);
+        return 1;
+    }
+    if (cell_format_parse(format_desc, &format) != 0)
+        return 1;
+    max_dist = cell_format_bins(&format);
+
+    long n_rows;
+    int16_t* points = read_cells(argv[optind], &n_rows);
+    if (points == NULL)
+        return 1;
+
+    uint64_t* expected = calloc(max_dist, sizeof(uint64_t));
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:expected[:max_dist])
+    for (long i = 0; i < n_rows; i++)
+        for (long j = i + 1; j < n_rows; j++)
+            expected[reference_bin(points + 3 * i, points + 3 * j, exact)]++;
+    free(points);
+
+    int status = 0;
+    if (optind + 1 >= argc){
+        for (int i = 0; i < max_dist; i++){
+            if (expected[i] != 0)
+                printf("%0*.*f %llu \n", cell_format_print_width(&format), cell_format_decimals(&format),
+                       i * cell_format_bin_width(&format), (unsigned long long) expected[i]);
+        }
+    } else {
+        uint64_t* counts = calloc(max_dist, sizeof(uint64_t));
+        if (read_histogram(argv[optind + 1], counts) != 0){
+            free(counts);
+            free(expected);
+            return 1;
+        }
+        int n_wrong = 0;
+        for (int i = 0; i < max_dist; i++){
+            if (counts[i] == expected[i])
+                continue;
+            if (n_wrong++ < 20)
+                fprintf(stderr, "bin %.*f: got %llu, expected %llu\n", cell_format_decimals(&format),
+                        i * (double) cell_format_bin_width(&format),
+                        (unsigned long long) counts[i], (unsigned long long) expected[i]);
+        }
+        if (n_wrong > 0){
+            fprintf(stderr, "%d of %d bins differ\n", n_wrong, max_dist);
+            status = 1;
+        }
+        free(counts);
+    }
+    free(expected);
+    return status;
+}
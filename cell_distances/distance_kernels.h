@@ -0,0 +1,328 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Maximum number of SIMD lanes, each lane increments its own sub-histogram
+#define MAX_LANES 16
+
+// Binning set up by distance_kernels_init, the defaults are bins of 10
+// coordinate units (0.01 for +dd.ddd coordinates)
+static int bin_units = 10; // width of a bin in coordinate units
+static float bin_scale = 0.1f; // 1 / bin_units
+static int lane_stride = 3472; // distance between two lane sub-histograms, the bins rounded up to 16
+
+// Exact integer binning. The bin of a squared distance d2 is the largest b
+// with bin_units^2*b*b <= d2. Squared distances in [2^e, 2^(e+1)) are split
+// into buckets of 2^bucket_shift[e], no wider than the gap between two bin
+// boundaries there, so the bin at the start of the bucket is off by at most
+// one and a single comparison with the next boundary corrects it. The squared
+// distances must stay below INT32_MAX, e.g. coordinates within +-13377 units.
+#define EXACT_EXPONENTS 31
+static uint32_t* bin_boundaries; // bin_units^2*b*b for b <= lane_stride
+static int32_t* bucket_bins;
+static int32_t bucket_offset[EXACT_EXPONENTS + 1]; // bucket of d2 is bucket_offset[e] + (d2 >> bucket_shift[e])
+static int32_t bucket_shift[EXACT_EXPONENTS + 1];
+
+// Function to set the bin width and the number of bins the kernels count into
+static void distance_kernels_init(int n_bins, int units)
+{
+    bin_units = units;
+    bin_scale = 1.0f / units;
+    lane_stride = (n_bins + 15) / 16 * 16;
+}
+
+// Function to convert a squared distance into its histogram bin
+static inline
+int bin_of_squared(float d2)
+{
+    // Calculates distance and converts back to int (truncating to the bin width)
+    return (int)(sqrtf(d2) * bin_scale);
+}
+
+// Function to calculate the histogram bin of the distance between two points in 3D space
+static inline
+int distances_3d(int16_t x1, int16_t y1, int16_t z1, int16_t x2, int16_t y2, int16_t z2)
+{
+    float dx = (float)(x1 - x2);
+    float dy = (float)(y1 - y2);
+    float dz = (float)(z1 - z2);
+
+    return bin_of_squared(dx * dx + dy * dy + dz * dz);
+}
+
+// Function to fill the tables of the exact integer binning, after distance_kernels_init
+static void exact_bins_init(void)
+{
+    uint64_t unit2 = (uint64_t) bin_units * bin_units;
+    bin_boundaries = (uint32_t*) malloc(sizeof(uint32_t) * (lane_stride + 1));
+    for (uint64_t b = 0; b <= (uint64_t) lane_stride; b++)
+        bin_boundaries[b] = b * b * unit2 < INT32_MAX ? (uint32_t)(b * b * unit2) : INT32_MAX;
+
+    // Two boundaries above 2^e are at least unit2*(2*b0+3) apart, b0 being the bin of 2^e
+    int n_buckets = 0;
+    uint32_t first_of[EXACT_EXPONENTS], count_of[EXACT_EXPONENTS];
+    for (int e = 0; e < EXACT_EXPONENTS; e++){
+        uint64_t b0 = (uint64_t)(sqrt((double)(1u << e) / unit2));
+        while (b0 > 0 && b0 * b0 * unit2 > (1u << e)) b0--;
+        uint64_t gap = unit2 * (2 * b0 + 3);
+        int shift = 0;
+        while (shift < 31 && ((uint64_t) 2 << shift) <= gap)
+            shift++;
+        first_of[e] = shift < 31 ? (1u << e) >> shift : 0; // index of the first bucket of this exponent
+        count_of[e] = first_of[e] > 0 ? first_of[e] : 1;
+        bucket_shift[e] = shift;
+        bucket_offset[e] = n_buckets - (int32_t) first_of[e];
+        n_buckets += count_of[e];
+    }
+
+    bucket_bins = (int32_t*) malloc(sizeof(int32_t) * n_buckets);
+    int b = 0;
+    for (int e = 0, i = 0; e < EXACT_EXPONENTS; e++){
+        for (uint32_t j = 0; j < count_of[e]; j++, i++){
+            uint32_t start = e == 0 ? 0 : (1u << e) + (j << bucket_shift[e]);
+            while (b + 1 < lane_stride && bin_boundaries[b + 1] <= start)
+                b++;
+            bucket_bins[i] = b;
+        }
+    }
+    // d2 >= 2^31 is out of range, keep it inside the tables by sending it to the last bucket
+    bucket_shift[EXACT_EXPONENTS] = 31;
+    bucket_offset[EXACT_EXPONENTS] = n_buckets - 2;
+}
+
+// Function to get the exact histogram bin of a squared distance without floating point
+static inline
+int exact_bin(uint32_t d2)
+{
+    int e = 31 - __builtin_clz(d2 | 1);
+    int b = bucket_bins[bucket_offset[e] + (int32_t)(d2 >> bucket_shift[e])];
+    return b + (d2 >= bin_boundaries[b + 1]);
+}
+
+// Function to calculate the exact histogram bin of the distance between two points
+static inline
+int exact_distances_3d(int16_t x1, int16_t y1, int16_t z1, int16_t x2, int16_t y2, int16_t z2)
+{
+    int32_t dx = x1 - x2;
+    int32_t dy = y1 - y2;
+    int32_t dz = z1 - z2;
+    return exact_bin((uint32_t)(dx * dx + dy * dy + dz * dz));
+}
+
+// A row kernel adds the distances between the point (x, y, z) and n points
+// stored as structure-of-arrays to the lane sub-histograms in sub
+typedef void (*row_kernel_t)(int16_t, int16_t, int16_t,
+                             const int16_t*, const int16_t*, const int16_t*, int, uint32_t*);
+
+static void row_kernel_scalar(int16_t x, int16_t y, int16_t z,
+                              const int16_t* bx, const int16_t* by, const int16_t* bz,
+                              int n, uint32_t* sub)
+{
+    for (int j = 0; j < n; j++)
+        sub[distances_3d(x, y, z, bx[j], by[j], bz[j])]++;
+}
+
+static void row_kernel_exact_scalar(int16_t x, int16_t y, int16_t z,
+                                    const int16_t* bx, const int16_t* by, const int16_t* bz,
+                                    int n, uint32_t* sub)
+{
+    for (int j = 0; j < n; j++)
+        sub[exact_distances_3d(x, y, z, bx[j], by[j], bz[j])]++;
+}
+
+#ifdef HAVE_X86_KERNELS
+// 8 pairs per instruction. Every lane owns a sub-histogram so the scalar
+// increments after the vector part never hit the same counter back to back.
+__attribute__((target("avx2")))
+static void row_kernel_avx2(int16_t x, int16_t y, int16_t z,
+                            const int16_t* bx, const int16_t* by, const int16_t* bz,
+                            int n, uint32_t* sub)
+{
+    const __m256i vx = _mm256_set1_epi32(x);
+    const __m256i vy = _mm256_set1_epi32(y);
+    const __m256i vz = _mm256_set1_epi32(z);
+    const __m256 scale = _mm256_set1_ps(bin_scale);
+    const __m256i lane_offset = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                   _mm256_set1_epi32(lane_stride));
+    int32_t bins[8] __attribute__((aligned(32)));
+
+    int j = 0;
+    for (; j + 8 <= n; j += 8){
+        __m256 dx = _mm256_cvtepi32_ps(_mm256_sub_epi32(vx,
+                        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(bx + j)))));
+        __m256 dy = _mm256_cvtepi32_ps(_mm256_sub_epi32(vy,
+                        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(by + j)))));
+        __m256 dz = _mm256_cvtepi32_ps(_mm256_sub_epi32(vz,
+                        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(bz + j)))));
+        // Same evaluation order as distances_3d so the bins are identical
+        __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                  _mm256_mul_ps(dz, dz));
+        __m256i bin = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sqrt_ps(d2), scale));
+        _mm256_store_si256((__m256i*) bins, _mm256_add_epi32(bin, lane_offset));
+        for (int l = 0; l < 8; l++)
+            sub[bins[l]]++;
+    }
+    row_kernel_scalar(x, y, z, bx + j, by + j, bz + j, n - j, sub);
+}
+
+// 16 pairs per instruction, same scheme as the AVX2 kernel
+__attribute__((target("avx512f")))
+static void row_kernel_avx512(int16_t x, int16_t y, int16_t z,
+                              const int16_t* bx, const int16_t* by, const int16_t* bz,
+                              int n, uint32_t* sub)
+{
+    const __m512i vx = _mm512_set1_epi32(x);
+    const __m512i vy = _mm512_set1_epi32(y);
+    const __m512i vz = _mm512_set1_epi32(z);
+    const __m512 scale = _mm512_set1_ps(bin_scale);
+    const __m512i lane_offset = _mm512_mullo_epi32(
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+        _mm512_set1_epi32(lane_stride));
+    int32_t bins[16] __attribute__((aligned(64)));
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16){
+        __m512 dx = _mm512_cvtepi32_ps(_mm512_sub_epi32(vx,
+                        _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(bx + j)))));
+        __m512 dy = _mm512_cvtepi32_ps(_mm512_sub_epi32(vy,
+                        _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(by + j)))));
+        __m512 dz = _mm512_cvtepi32_ps(_mm512_sub_epi32(vz,
+                        _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(bz + j)))));
+        __m512 d2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)),
+                                  _mm512_mul_ps(dz, dz));
+        __m512i bin = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_sqrt_ps(d2), scale));
+        _mm512_store_si512((void*) bins, _mm512_add_epi32(bin, lane_offset));
+        for (int l = 0; l < 16; l++)
+            sub[bins[l]]++;
+    }
+    row_kernel_scalar(x, y, z, bx + j, by + j, bz + j, n - j, sub);
+}
+
+// Exact integer binning, 8 pairs per instruction. AVX2 has no per-lane
+// leading zero count, so the exponent of d2 is found by halving.
+__attribute__((target("avx2")))
+static void row_kernel_exact_avx2(int16_t x, int16_t y, int16_t z,
+                                  const int16_t* bx, const int16_t* by, const int16_t* bz,
+                                  int n, uint32_t* sub)
+{
+    const __m256i vx = _mm256_set1_epi32(x);
+    const __m256i vy = _mm256_set1_epi32(y);
+    const __m256i vz = _mm256_set1_epi32(z);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i lane_offset = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                   _mm256_set1_epi32(lane_stride));
+    int32_t bins[8] __attribute__((aligned(32)));
+
+    int j = 0;
+    for (; j + 8 <= n; j += 8){
+        __m256i dx = _mm256_sub_epi32(vx, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(bx + j))));
+        __m256i dy = _mm256_sub_epi32(vy, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(by + j))));
+        __m256i dz = _mm256_sub_epi32(vz, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(bz + j))));
+        __m256i d2 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy)),
+                                      _mm256_mullo_epi32(dz, dz));
+
+        // e = floor(log2(d2 | 1))
+        __m256i t = _mm256_or_si256(d2, one);
+        __m256i e = _mm256_setzero_si256();
+        for (int step = 16; step > 0; step /= 2){
+            __m256i above = _mm256_cmpgt_epi32(t, _mm256_set1_epi32((1 << step) - 1));
+            __m256i shift = _mm256_and_si256(above, _mm256_set1_epi32(step));
+            e = _mm256_add_epi32(e, shift);
+            t = _mm256_srlv_epi32(t, shift);
+        }
+
+        __m256i bucket = _mm256_add_epi32(_mm256_i32gather_epi32(bucket_offset, e, 4),
+                                          _mm256_srlv_epi32(d2, _mm256_i32gather_epi32(bucket_shift, e, 4)));
+        __m256i bin = _mm256_i32gather_epi32(bucket_bins, bucket, 4);
+        __m256i next = _mm256_i32gather_epi32((const int*)(bin_boundaries + 1), bin, 4);
+        // bin + (d2 >= next), all values are below 2^31 so the signed compare is fine
+        bin = _mm256_add_epi32(bin, _mm256_add_epi32(one, _mm256_cmpgt_epi32(next, d2)));
+        _mm256_store_si256((__m256i*) bins, _mm256_add_epi32(bin, lane_offset));
+        for (int l = 0; l < 8; l++)
+            sub[bins[l]]++;
+    }
+    row_kernel_exact_scalar(x, y, z, bx + j, by + j, bz + j, n - j, sub);
+}
+
+// Exact integer binning, 16 pairs per instruction
+__attribute__((target("avx512f,avx512cd")))
+static void row_kernel_exact_avx512(int16_t x, int16_t y, int16_t z,
+                                    const int16_t* bx, const int16_t* by, const int16_t* bz,
+                                    int n, uint32_t* sub)
+{
+    const __m512i vx = _mm512_set1_epi32(x);
+    const __m512i vy = _mm512_set1_epi32(y);
+    const __m512i vz = _mm512_set1_epi32(z);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i top_bit = _mm512_set1_epi32(31);
+    // The 32 entry exponent tables fit in two registers each and are permuted instead of gathered
+    const __m512i offset_lo = _mm512_loadu_si512(bucket_offset);
+    const __m512i offset_hi = _mm512_loadu_si512(bucket_offset + 16);
+    const __m512i shift_lo = _mm512_loadu_si512(bucket_shift);
+    const __m512i shift_hi = _mm512_loadu_si512(bucket_shift + 16);
+    const __m512i lane_offset = _mm512_mullo_epi32(
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+        _mm512_set1_epi32(lane_stride));
+    int32_t bins[16] __attribute__((aligned(64)));
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16){
+        __m512i dx = _mm512_sub_epi32(vx, _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(bx + j))));
+        __m512i dy = _mm512_sub_epi32(vy, _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(by + j))));
+        __m512i dz = _mm512_sub_epi32(vz, _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(bz + j))));
+        __m512i d2 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(dx, dx), _mm512_mullo_epi32(dy, dy)),
+                                      _mm512_mullo_epi32(dz, dz));
+
+        __m512i e = _mm512_sub_epi32(top_bit, _mm512_lzcnt_epi32(_mm512_or_si512(d2, one)));
+        __m512i bucket = _mm512_add_epi32(_mm512_permutex2var_epi32(offset_lo, e, offset_hi),
+                                          _mm512_srlv_epi32(d2, _mm512_permutex2var_epi32(shift_lo, e, shift_hi)));
+        __m512i bin = _mm512_i32gather_epi32(bucket, bucket_bins, 4);
+        __m512i next = _mm512_i32gather_epi32(bin, bin_boundaries + 1, 4);
+        bin = _mm512_mask_add_epi32(bin, _mm512_cmpge_epu32_mask(d2, next), bin, one);
+        _mm512_store_si512((void*) bins, _mm512_add_epi32(bin, lane_offset));
+        for (int l = 0; l < 16; l++)
+            sub[bins[l]]++;
+    }
+    row_kernel_exact_scalar(x, y, z, bx + j, by + j, bz + j, n - j, sub);
+}
+#endif
+
+// Function to pick the widest row kernel the CPU supports, or the one named by
+// name ("scalar", "avx2" or "avx512") if it is not NULL. With exact the kernel
+// bins with integers only (exact_bins_init must have been called). The number
+// of lane sub-histograms the kernel writes is stored in lanes.
+static row_kernel_t select_row_kernel(const char* name, bool exact, int* lanes)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool has_avx512 = __builtin_cpu_supports("avx512f") &&
+                      (!exact || __builtin_cpu_supports("avx512cd"));
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (name == NULL)
+        name = has_avx512 ? "avx512" : has_avx2 ? "avx2" : "scalar";
+    if (strcmp(name, "avx512") == 0 && has_avx512){
+        *lanes = 16;
+        return exact ? row_kernel_exact_avx512 : row_kernel_avx512;
+    }
+    if (strcmp(name, "avx2") == 0 && has_avx2){
+        *lanes = 8;
+        return exact ? row_kernel_exact_avx2 : row_kernel_avx2;
+    }
+#endif
+    if (name != NULL && strcmp(name, "scalar") != 0)
+        fprintf(stderr, "kernel %s is not supported, using scalar\n", name);
+    *lanes = 1;
+    return exact ? row_kernel_exact_scalar : row_kernel_scalar;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "cell_format.h"
+
+// Writes a synthetic cells file: rows of three coordinates within the range of
+// a format descriptor (by default +dd.ddd in [-10, 10], 24-byte rows) as
+// cell_distances reads them. The same seed always gives the same file,
+// independent of the C library.
+
+// Function prototypes
+uint64_t next_random(uint64_t*);
+double uniform(uint64_t*);
+double normal(uint64_t*);
+int to_units(double);
+void write_coord(FILE*, int, char);
+
+// Format of the written rows
+cell_format_t format;
+double unit_scale; // units per coordinate, 10^frac_digits
+
+// Function to advance the splitmix64 generator and return its next value
+uint64_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Function to draw a double uniformly from [0, 1)
+double uniform(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function to draw a standard normal number (Box-Muller)
+double normal(uint64_t* state)
+{
+    double u = 1.0 - uniform(state);
+    double v = uniform(state);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+// Function to round a coordinate to units and clamp it to the range of the format
+int to_units(double coord)
+{
+    long m = lround(coord * unit_scale);
+    if (m < -format.max_coord) m = -format.max_coord;
+    if (m > format.max_coord) m = format.max_coord;
+    return (int) m;
+}
+
+// Function to write one coordinate, e.g. +dd.ddd, followed by sep
+void write_coord(FILE* fp, int units, char sep)
+{
+    int a = units < 0 ? -units : units;
+    int scale = (int) unit_scale;
+    fprintf(fp, "%c%0*d.%0*d%c", units < 0 ? '-' : '+', format.int_digits, a / scale,
+            format.frac_digits, a % scale, sep);
+}
+
+int main(int argc, char* argv[]){
+    long n_rows = 1000;
+    uint64_t seed = 1;
+    const char* distribution = "uniform";
+    const char* path = NULL;
+    const char* format_desc = CELL_FORMAT_DEFAULT;
+    int n_clusters = 8;
+    double spread = 0.5; // standard deviation of normal and cluster points
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:d:c:w:o:f:")) != -1){
+        switch(opt){
+            case 'n':
+                // Number of rows
+                n_rows = atol(optarg);
+                break;
+            case 's':
+                // Seed of the random generator
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                // Distribution: uniform, normal (around the origin) or cluster
+                distribution = optarg;
+                break;
+            case 'c':
+                // Number of clusters of the cluster distribution
+                n_clusters = atoi(optarg);
+                break;
+            case 'w':
+                // Standard deviation of the normal and cluster distributions
+                spread = atof(optarg);
+                break;
+            case 'o':
+                // Output file instead of stdout
+                path = optarg;
+                break;
+            case 'f':
+                // Format of the rows as INT.FRAC[,BIN[,RANGE]], see cell_format.h
+                format_desc = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rows] [-s seed] [-d uniform|normal|cluster] "
+                                "[-c clusters] [-w spread] [-o file] [-f format]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (n_rows < 0 || n_clusters < 1 || (strcmp(distribution, "uniform") != 0 &&
+        strcmp(distribution, "normal") != 0 && strcmp(distribution, "cluster") != 0)){
+        fprintf(stderr, "Invalid rows, clusters or distribution %s\n", distribution);
+        return 1;
+    }
+    if (cell_format_parse(format_desc, &format) != 0)
+        return 1;
+    unit_scale = pow(10, format.frac_digits);
+    double range = format.max_coord / unit_scale;
+
+    FILE* fp = path != NULL ? fopen(path, "w") : stdout;
+    if (fp == NULL){
+        perror("Error opening output file");
+        return 1;
+    }
+
+    uint64_t state = seed;
+    double (*centers)[3] = malloc(sizeof(double[3]) * n_clusters);
+    for (int c = 0; c < n_clusters; c++)
+        for (int k = 0; k < 3; k++)
+            centers[c][k] = (uniform(&state) * 1.6 - 0.8) * range;
+
+    for (long i = 0; i < n_rows; i++){
+        int coord[3];
+        int c = distribution[0] == 'c' ? (int)(next_random(&state) % n_clusters) : 0;
+        for (int k = 0; k < 3; k++){
+            if (distribution[0] == 'u')
+                coord[k] = to_units((uniform(&state) * 2.0 - 1.0) * range);
+            else if (distribution[0] == 'n')
+                coord[k] = to_units(normal(&state) * spread);
+            else
+                coord[k] = to_units(centers[c][k] + normal(&state) * spread);
+        }
+        write_coord(fp, coord[0], ' ');
+        write_coord(fp, coord[1], ' ');
+        write_coord(fp, coord[2], '\n');
+    }
+
+    free(centers);
+    if (fp != stdout && fclose(fp) != 0){
+        perror("Error writing output file");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// Output formats of the images (-f)
+enum {
+  format_p3,  // ASCII PPM, 12 bytes per pixel
+  format_p6,  // binary PPM, 3 bytes per pixel
+  format_png  // indexed PNG, one compressed palette index per pixel
+};
+
+// Length of color string "xxx xxx xxx "
+#define COLOR_STRING_LENGTH 12
+
+// Size of the compressed data buffered before it is written as an IDAT chunk
+#define PNG_CHUNK_SIZE (1 << 16)
+
+// Image written row by row. Every pixel is an index into a palette of up to
+// 256 colors, given as the strings of color_encodings.h.
+typedef struct {
+  FILE *fp;
+  int format;
+  int width;
+  const char (*colors)[13]; // P3 text of each palette entry
+  uint8_t rgb[256][3]; // the same colors as bytes
+  uint8_t *line; // one converted row, or filter byte and indices for PNG
+  z_stream zs;
+  uint8_t *zbuf; // compressed data of the next IDAT chunk
+} image_writer_t;
+
+// Function to write a PNG chunk
+static void png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t length)
+{
+  uint8_t header[8] = {length >> 24, length >> 16, length >> 8, length, type[0], type[1], type[2], type[3]};
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+  if (length > 0)
+    crc = crc32(crc, data, length);
+  uint8_t trailer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+  fwrite(header, 1, 8, fp);
+  if (length > 0)
+    fwrite(data, 1, length, fp);
+  fwrite(trailer, 1, 4, fp);
+}
+
+// Function to deflate the input of the stream and write every full chunk. With
+// Z_FINISH the rest of the stream is written too.
+static void png_deflate(image_writer_t *img, int flush)
+{
+  int ret;
+  do {
+    ret = deflate(&img->zs, flush);
+    uint32_t length = PNG_CHUNK_SIZE - img->zs.avail_out;
+    if (img->zs.avail_out == 0 || (ret == Z_STREAM_END && length > 0)) {
+      png_chunk(img->fp, "IDAT", img->zbuf, length);
+      img->zs.next_out = img->zbuf;
+      img->zs.avail_out = PNG_CHUNK_SIZE;
+    }
+  } while (flush == Z_FINISH ? ret != Z_STREAM_END : img->zs.avail_in > 0);
+}
+
+// Function to create the file at path and write the header of a width x height
+// image with n_colors colors. Returns 0 on success.
+static int image_open(image_writer_t *img, const char *path, int format, int width, int height,
+                      const char (*colors)[13], int n_colors)
+{
+  img->fp = fopen(path, "wb");
+  if (img->fp == NULL) {
+    perror("Error opening image");
+    return 1;
+  }
+  img->format = format;
+  img->width = width;
+  img->colors = colors;
+  for (int c = 0; c < n_colors; c++) {
+    unsigned r, g, b;
+    sscanf(colors[c], "%u %u %u", &r, &g, &b);
+    img->rgb[c][0] = r;
+    img->rgb[c][1] = g;
+    img->rgb[c][2] = b;
+  }
+
+  if (format == format_p3 || format == format_p6) {
+    fprintf(img->fp, "%s\n%i %i\n255\n", format == format_p3 ? "P3" : "P6", width, height);
+    img->line = (uint8_t*) malloc((size_t) width * (format == format_p3 ? COLOR_STRING_LENGTH : 3));
+    return 0;
+  }
+
+  // 8-bit indexed PNG, deflated for speed: long runs of one root compress well with Z_RLE
+  static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  uint8_t ihdr[13] = {width >> 24, width >> 16, width >> 8, width,
+                      height >> 24, height >> 16, height >> 8, height, 8, 3, 0, 0, 0};
+  fwrite(signature, 1, 8, img->fp);
+  png_chunk(img->fp, "IHDR", ihdr, 13);
+  png_chunk(img->fp, "PLTE", &img->rgb[0][0], 3 * n_colors);
+
+  img->line = (uint8_t*) malloc((size_t) width + 1);
+  img->zbuf = (uint8_t*) malloc(PNG_CHUNK_SIZE);
+  memset(&img->zs, 0, sizeof(img->zs));
+  deflateInit2(&img->zs, Z_BEST_SPEED, Z_DEFLATED, 15, 8, Z_RLE);
+  img->zs.next_out = img->zbuf;
+  img->zs.avail_out = PNG_CHUNK_SIZE;
+  return 0;
+}
+
+// Function to append the next row of palette indices
+static void image_write_row(image_writer_t *img, const uint8_t *indices)
+{
+  const int width = img->width;
+  switch (img->format) {
+    case format_p3:
+      for (int j = 0; j < width; j++)
+        memcpy(img->line + j*COLOR_STRING_LENGTH, img->colors[indices[j]], COLOR_STRING_LENGTH);
+      fwrite(img->line, 1, (size_t) width*COLOR_STRING_LENGTH, img->fp);
+      return;
+    case format_p6:
+      for (int j = 0; j < width; j++)
+        memcpy(img->line + 3*j, img->rgb[indices[j]], 3);
+      fwrite(img->line, 1, (size_t) width*3, img->fp);
+      return;
+    default:
+      // Filter type 0, the indices as they are
+      img->line[0] = 0;
+      memcpy(img->line + 1, indices, width);
+      img->zs.next_in = img->line;
+      img->zs.avail_in = width + 1;
+      png_deflate(img, Z_NO_FLUSH);
+  }
+}
+
+// Function to finish the image and close its file
+static void image_close(image_writer_t *img)
+{
+  if (img->format == format_png) {
+    png_deflate(img, Z_FINISH);
+    deflateEnd(&img->zs);
+    png_chunk(img->fp, "IEND", NULL, 0);
+    free(img->zbuf);
+  }
+  free(img->line);
+  fclose(img->fp);
+}
+
+#endif
@@ -2,245 +2,872 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <float.h>
 #include <math.h>
 #include <string.h>
 #include <threads.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include "color_encodings.h"
+#include "newton_kernels.h"
+#include "newton_deep_kernels.h"
+#include "image_writer.h"
 
 // Global variables for user input arguments
-int n_threads, sz, degree;
-const long upper_bnd = 10000000000; // Upper bound constant
-const float lower_bnd_squared = 0.000001f; // Lower bound squared constant
-const int color_string_length = 12; // Length of color string "xxx xxx xxx "
-
-// Explicit root solutions for each polynomial degree between 1 and 9
-const float root_solutions[9][9][2] = {
-  // Solutions for degree 1
-  {{1.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 2
-  {{1.f,0.f}, {-1.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 3
-  {{1.f,0.f}, {-0.5f,0.86603f}, {-0.5f,-0.86603f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 4
-  {{1.f,0.f}, {-1.f,0.f}, {0.f,1.f}, {0.f,-1.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 5
-  {{1.f,0.f}, {0.30902f,0.95106f}, {0.30902f,-0.95106f}, {-0.80902f,0.58779f}, {-0.80902f,-0.58779f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 6
-  {{1.f,0.f}, {-1.f,0.f}, {0.5f,0.86603f}, {-0.5f,-0.86603f}, {-0.5f,0.86603f}, {0.5f,-0.86603f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 7
-  {{1.f,0.f}, {-0.90097f,-0.43388f}, {-0.90097f,0.43388f}, {-0.22252f,-0.97493f}, {-0.22252f,0.97493f}, {0.62349f,-0.78183f}, {0.62349f,0.78183f}, {0.f,0.f}, {0.f,0.f}},
-  // Solutions for degree 8
-  {{1.f,0.f}, {-1.f,0.f}, {0.f,1.f}, {0.f,-1.f}, {0.70711f,0.70711f}, {-0.70711f,-0.70711f}, {-0.70711f,0.70711f}, {0.70711f,-0.70711f}, {0.f,0.f} },
-  // Solutions for degree 9
-  {{1.f,0.f}, {-0.93969f,-0.34202f}, {-0.93969f,0.34202f}, {0.76604f,0.64279f}, {0.76604f,-0.64279f}, {-0.5f,-0.86603f}, {-0.5f,0.86603f}, {0.17365f,0.98481f}, {0.17365f,-0.98481f}}
-};
-
-// Structure for complex numbers
-typedef struct{
-  float re;
-  float im;
-} complex;
-
-// Function to perform Newton step for a given polynomial degree
-complex newton_step(int degree, float x, float y){
-  float denom, x2y2, xnumer, ynumer;
-  x2y2=x*x+y*y;
-  switch(degree){
-    case 1:
-      return (complex){1.f, 0.f};
-    case 2:
-      denom = 2*x2y2;
-      return (complex){x*0.5f + x/denom, y*0.5f - y/denom};
-    case 3:
-      denom = 3.f*x2y2*x2y2; 
-      xnumer = x*x - y*y;
-      ynumer = 2.f*x*y;
-      return (complex){x*(2.f/3.f) + (xnumer)/denom,y*(2.f/3.f) - ynumer/denom};
-    // Cases for other degrees omitted for brevity...
-    default:
-      fprintf(stderr, "unexpected degree\n");
-      exit(1);
-  }
+int n_threads, width, height, degree;
+int output_format = format_p3; // format of the images (-f p3|p6|png)
+const int rows_in_flight = 4; // row slots per computation thread
+bool subdivide = false; // render by rectangle subdivision (--subdivide)
+int band_rows = 1; // rows handed out and published together, subdivide_band_rows with --subdivide
+const int subdivide_band_rows = 64;
+const int subdivide_min_pixels = 64; // rectangles with no more pixels inside are computed in full
+const int subdivide_batch = 4096; // points computed together by subdivision
+
+// Region of the complex plane shown by the image, [-2,2]x[-2,2] unless set
+// with -r or --center and --span. The corner is kept in double-double so that
+// deep zooms can place it finer than a pixel.
+typedef struct {
+  dd_t re_min;
+  dd_t im_min;
+  double re_span;
+  double im_span;
+} viewport_t;
+
+viewport_t viewport = {{-2., 0.}, {-2., 0.}, 4., 4.};
+
+// Precision of the coordinates and the iteration, the narrowest one that
+// resolves the pixels of the viewport unless set with --precision
+int precision = -1;
+
+// Function to store the coordinate of pixel index i of n along an axis of the
+// viewport at coords[k], as float or as double-double after the precision
+static void viewport_store(dd_t min, double span, int i, int n, void *coords, int k)
+{
+  if (precision == precision_float)
+    ((float*) coords)[k] = ((float)i) / ((float) n) * (float) span + (float) min.hi;
+  else
+    ((dd_t*) coords)[k] = dd_add_d(min, ((double)i) / ((double) n) * span);
+}
+
+// Function to pick the narrowest precision in which neighbouring pixels are
+// at least 16 units in the last place of the largest coordinate apart
+static int viewport_precision(void)
+{
+  double mag = fmax(fmax(fabs(viewport.re_min.hi), fabs(viewport.re_min.hi + viewport.re_span)),
+                    fmax(fabs(viewport.im_min.hi), fabs(viewport.im_min.hi + viewport.im_span)));
+  double step = fmin(viewport.re_span / width, viewport.im_span / height);
+  if (step >= 16 * mag * FLT_EPSILON)
+    return precision_float;
+  if (step >= 16 * mag * DBL_EPSILON)
+    return precision_double;
+  if (step < 16 * mag * DBL_EPSILON * DBL_EPSILON)
+    fprintf(stderr, "The pixels are finer than double-double precision resolves\n");
+  return precision_dd;
 }
 
-// Structure for returning root and iteration count
+// Strip kernel of the degree and precision, picked at startup from the CPU features (-k to force one)
+newton_strip_t newton_strip;
+newton_deep_strip_t newton_deep_strip;
+
+// Function to get the size of a coordinate in the precision
+static size_t coord_size(void)
+{
+  return precision == precision_float ? sizeof(float) : sizeof(dd_t);
+}
+
+// Function to run the strip kernel of the precision on the n points (re[j], im[j])
+static void newton_row(const void *re, const void *im, int n, uint8_t *roots, uint8_t *iters)
+{
+  if (precision == precision_float)
+    newton_strip(re, im, n, roots, iters);
+  else
+    newton_deep_strip(re, im, n, roots, iters);
+}
+
+// Rectangle of a region whose border is computed
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} subdiv_rect_t;
+
+// Region of pixels rendered by subdivision, a band of rows of the image or a
+// tile. The pixels to compute are gathered in batches, so that the strip
+// kernels run on many points at once even for short lines.
 typedef struct {
-  uint8_t root;
-  uint8_t iter;
-} return_tuple;
+  int x0; // first pixel of the region in its level
+  int y0;
+  int scale; // pixels of the image per pixel of the level along each axis
+  uint8_t *attractors; // pixels of the region, stride pixels per row
+  uint8_t *convergences;
+  int stride;
+  void *re; // coordinates, results and offsets of the batch
+  void *im;
+  uint8_t *roots;
+  uint8_t *iters;
+  int *offsets;
+  int n_points;
+  subdiv_rect_t *rects; // rectangles of this round and, after them, of the next
+  int n_rects;
+  int rects_capacity;
+} subdiv_region_t;
 
-// Function to run the Newton algorithm for a given starting position in the complex plane
-return_tuple newton_algorithm(float re, float im, int degree)
+// Function to allocate the scratch of a region
+static void subdiv_region_init(subdiv_region_t *r)
 {
-  float dre, dim;
+  r->re = malloc(subdivide_batch*coord_size());
+  r->im = malloc(subdivide_batch*coord_size());
+  r->roots = (uint8_t*) malloc(subdivide_batch*sizeof(uint8_t));
+  r->iters = (uint8_t*) malloc(subdivide_batch*sizeof(uint8_t));
+  r->offsets = (int*) malloc(subdivide_batch*sizeof(int));
+  r->n_points = 0;
+  r->rects_capacity = 64;
+  r->rects = (subdiv_rect_t*) malloc(r->rects_capacity*sizeof(subdiv_rect_t));
+}
 
-  for (uint8_t i = 0;; ++i) {
-    // Check if the iteration count exceeds the limit or the point diverges
-    if(fabs(re)>upper_bnd || fabs(im)>upper_bnd || re*re+im*im<lower_bnd_squared || i==128){
-      return (return_tuple){10, i};
-    }
-    // Check for convergence to each root
-    for (int8_t j = 0; j < degree; j++)
-    {
-      dre=re-root_solutions[degree-1][j][0];
-      dim=im-root_solutions[degree-1][j][1];
-      if (dre * dre + dim * dim < 0.000001f)
-      {
-        return (return_tuple){j+1, i};
+// Function to free the scratch of a region
+static void subdiv_region_free(subdiv_region_t *r)
+{
+  free(r->re);
+  free(r->im);
+  free(r->roots);
+  free(r->iters);
+  free(r->offsets);
+  free(r->rects);
+}
+
+// Function to compute the points of the batch and store them in the region
+static void subdiv_flush(subdiv_region_t *r)
+{
+  newton_row(r->re, r->im, r->n_points, r->roots, r->iters);
+  for (int k = 0; k < r->n_points; k++) {
+    r->attractors[r->offsets[k]] = r->roots[k];
+    r->convergences[r->offsets[k]] = r->iters[k];
+  }
+  r->n_points = 0;
+}
+
+// Function to add n pixels of the region to the batch, from (x, y) in steps of (dx, dy)
+static void subdiv_line(subdiv_region_t *r, int x, int y, int dx, int dy, int n)
+{
+  for (int k = 0; k < n; k++, x += dx, y += dy) {
+    viewport_store(viewport.re_min, viewport.re_span, (r->x0 + x)*r->scale, width, r->re, r->n_points);
+    viewport_store(viewport.im_min, viewport.im_span, (r->y0 + y)*r->scale, height, r->im, r->n_points);
+    r->offsets[r->n_points] = y*r->stride + x;
+    if (++r->n_points == subdivide_batch)
+      subdiv_flush(r);
+  }
+}
+
+// Function to queue a rectangle for the next round
+static void subdiv_push(subdiv_region_t *r, int x, int y, int w, int h)
+{
+  if (r->n_rects == r->rects_capacity) {
+    r->rects_capacity *= 2;
+    r->rects = (subdiv_rect_t*) realloc(r->rects, r->rects_capacity*sizeof(subdiv_rect_t));
+  }
+  r->rects[r->n_rects++] = (subdiv_rect_t){x, y, w, h};
+}
+
+// Function to handle a rectangle whose border is computed. A border that
+// converges to one root all round is taken to hold the whole basin, and the
+// inside gets that root without iterating; its iteration counts are
+// interpolated from the border. Otherwise the inside of a small rectangle is
+// computed in full, and a larger one split in two along a line that is
+// computed for the next round.
+static void subdiv_rect(subdiv_region_t *r, subdiv_rect_t rect)
+{
+  const int x = rect.x, y = rect.y, w = rect.w, h = rect.h;
+  if (w <= 2 || h <= 2)
+    return;
+  const uint8_t *a = r->attractors;
+  const int s = r->stride;
+  const uint8_t root = a[y*s + x];
+  bool uniform = root != 10;
+  for (int jx = x; jx < x + w && uniform; ++jx)
+    uniform = a[y*s + jx] == root && a[(y + h - 1)*s + jx] == root;
+  for (int ix = y; ix < y + h && uniform; ++ix)
+    uniform = a[ix*s + x] == root && a[ix*s + x + w - 1] == root;
+
+  if (uniform) {
+    // Mean of the linear interpolations across and down, in 16.16 fixed point
+    uint8_t *c = r->convergences;
+    const uint8_t *top = c + y*s, *bottom = c + (y + h - 1)*s;
+    for (int ix = y + 1; ix < y + h - 1; ++ix) {
+      uint8_t *row = c + ix*s;
+      const int t = (ix - y)*65536 / (h - 1);
+      const int step = (row[x + w - 1] - row[x])*65536 / (w - 1);
+      int across = row[x]*65536;
+      memset(r->attractors + ix*s + x + 1, root, w - 2);
+      for (int jx = x + 1; jx < x + w - 1; ++jx) {
+        across += step;
+        int down = top[jx]*65536 + (bottom[jx] - top[jx])*t;
+        row[jx] = (uint8_t) ((across + down + 65536) >> 17);
       }
     }
+  }
+  else if ((w - 2)*(h - 2) <= subdivide_min_pixels) {
+    for (int ix = y + 1; ix < y + h - 1; ++ix)
+      subdiv_line(r, x + 1, ix, 1, 0, w - 2);
+  }
+  else if (w >= h) {
+    const int mid = x + w/2;
+    subdiv_line(r, mid, y + 1, 0, 1, h - 2);
+    subdiv_push(r, x, y, mid - x + 1, h);
+    subdiv_push(r, mid, y, x + w - mid, h);
+  }
+  else {
+    const int mid = y + h/2;
+    subdiv_line(r, x + 1, mid, 1, 0, w - 2);
+    subdiv_push(r, x, y, w, mid - y + 1);
+    subdiv_push(r, x, mid, w, y + h - mid);
+  }
+}
+
+// Function to render the w x h pixels of a region by subdivision: its border
+// first, then round by round the rectangles split off in the round before
+static void subdiv_render(subdiv_region_t *r, int w, int h)
+{
+  subdiv_line(r, 0, 0, 1, 0, w);
+  if (h > 1)
+    subdiv_line(r, 0, h - 1, 1, 0, w);
+  if (h > 2) {
+    subdiv_line(r, 0, 1, 0, 1, h - 2);
+    if (w > 1)
+      subdiv_line(r, w - 1, 1, 0, 1, h - 2);
+  }
+  subdiv_flush(r);
+
+  r->n_rects = 0;
+  subdiv_push(r, 0, 0, w, h);
+  while (r->n_rects > 0) {
+    const int n_round = r->n_rects;
+    for (int k = 0; k < n_round; ++k)
+      subdiv_rect(r, r->rects[k]);
+    subdiv_flush(r);
+    r->n_rects -= n_round;
+    memmove(r->rects, r->rects + n_round, r->n_rects*sizeof(subdiv_rect_t));
+  }
+}
+
+// Ring of n_slots row slots shared without locks: row ix is computed into
+// slot ix % n_slots. A finished row is published by storing its index in
+// slot_row with release semantics, after which finished is bumped. A slot is
+// reused once the writer has written its previous row. The writer only sleeps
+// on finished when the next row it needs is not ready, computation threads
+// only sleep on written when their slot is still taken, and each side only
+// wakes the other when it said it sleeps. With --subdivide the rows of the
+// ring are bands of band_rows rows, which are handed out and published whole.
+typedef struct {
+  atomic_int *slot_row; // row whose data is ready in each slot, -1 when none
+  int n_slots;
+  atomic_uint finished; // rows finished so far, the futex word the writer sleeps on
+  atomic_int writer_waiting; // the writer sleeps or is about to
+  atomic_uint written; // rows written so far, the futex word computation threads sleep on
+  atomic_int workers_waiting; // computation threads that sleep or are about to
+} row_sync_t;
+
+// Function to sleep until *word is no longer expected (or spuriously)
+static void futex_wait(atomic_uint *word, unsigned expected)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+  (void) word;
+  (void) expected;
+  thrd_yield();
+#endif
+}
 
-    // Perform Newton step
-    complex post_step = newton_step(degree, re, im);
-    re = post_step.re;
-    im = post_step.im;
+// Function to wake up to n threads sleeping on word
+static void futex_wake(atomic_uint *word, int n)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+  (void) word;
+  (void) n;
+#endif
+}
+
+// Function to wait until the slot of row ix is free, i.e. the writer has
+// written row ix - n_slots. Rows are taken in order, so the row the writer
+// waits for always has its slot and the ring can not deadlock.
+static void row_reserve(row_sync_t *sync, int ix)
+{
+  while (atomic_load(&sync->written) + sync->n_slots <= (unsigned) ix) {
+    unsigned seen = atomic_load(&sync->written);
+    if (seen + sync->n_slots > (unsigned) ix)
+      break;
+    atomic_fetch_add(&sync->workers_waiting, 1);
+    if (atomic_load(&sync->written) == seen)
+      futex_wait(&sync->written, seen);
+    atomic_fetch_sub(&sync->workers_waiting, 1);
   }
 }
 
+// Function to mark row ix as finished, its data must be stored before
+static void row_publish(row_sync_t *sync, int ix)
+{
+  atomic_store_explicit(&sync->slot_row[ix % sync->n_slots], ix, memory_order_release);
+  atomic_fetch_add(&sync->finished, 1);
+  if (atomic_load(&sync->writer_waiting))
+    futex_wake(&sync->finished, 1);
+}
+
+// Function to wait until row ix is finished. Either the writer sees the
+// bumped counter after announcing that it waits, or the publishing thread
+// sees the announcement and wakes it, so no wakeup is lost.
+static void row_wait(row_sync_t *sync, int ix)
+{
+  atomic_int *slot_row = &sync->slot_row[ix % sync->n_slots];
+  while (atomic_load_explicit(slot_row, memory_order_acquire) != ix) {
+    unsigned seen = atomic_load(&sync->finished);
+    if (atomic_load_explicit(slot_row, memory_order_acquire) == ix)
+      break;
+    atomic_store(&sync->writer_waiting, 1);
+    if (atomic_load(&sync->finished) == seen)
+      futex_wait(&sync->finished, seen);
+    atomic_store(&sync->writer_waiting, 0);
+  }
+}
+
+// Function to hand the slot of row ix back once the row is written
+static void row_release(row_sync_t *sync, int ix)
+{
+  atomic_store(&sync->written, ix + 1);
+  if (atomic_load(&sync->workers_waiting))
+    futex_wake(&sync->written, INT32_MAX);
+}
+
 // Structure for passing information to computation threads
 typedef struct {
-  const float **re;
-  const float **im;
-  uint8_t **convergences;
-  uint8_t **attractors;
-  int ib;
-  int istep;
-  int sz;
-  int tx;
-  mtx_t *mtx;
-  cnd_t *cnd;
-  int_padded *status;
+  const void *re; // real parts of the columns, the same for every row
+  uint8_t *convergences; // ring of sync->n_slots rows
+  uint8_t *attractors;
+  atomic_int *next_row; // next row that no thread has taken yet
+  int width;
+  int height;
+  row_sync_t *sync;
 } thrd_info_t;
 
 // Structure for passing information to the check thread
 typedef struct {
-  const float **re;
-  const float **im;
-  uint8_t **convergences;
-  uint8_t **attractors;
-  int sz;
-  int n_threads;
-  mtx_t *mtx;
-  cnd_t *cnd;
-  int_padded *status;
+  uint8_t *convergences; // ring of sync->n_slots rows
+  uint8_t *attractors;
+  int width;
+  int height;
+  row_sync_t *sync;
 } thrd_info_check_t;
 
 // Function to be executed by computation threads
 int main_thrd(void *args)
 {
   const thrd_info_t *thrd_info = (thrd_info_t*) args;
-  const float **im = thrd_info->im;
-  const float **re = thrd_info->re;
-  uint8_t **convergences = thrd_info->convergences;
-  uint8_t **attractors = thrd_info->attractors;
-  const int ib = thrd_info->ib;
-  const int istep = thrd_info->istep;
-  const int sz = thrd_info->sz;
-  const int tx = thrd_info->tx;
-  mtx_t *mtx = thrd_info->mtx;
-  cnd_t *cnd = thrd_info->cnd;
-  int_padded *status = thrd_info->status;
-
-  // Loop over all rows the thread will compute
-  for (int ix = ib; ix < sz; ix += istep) {
-    const float *reix = re[ix];
-    const float *imix = im[ix];
-    // Allocate memory for the rows of the result before computing
-    uint8_t *attractor = (uint8_t*) malloc(sz*sizeof(uint8_t));
-    uint8_t *convergence = (uint8_t*) malloc(sz*sizeof(uint8_t));
-
-    // Loop over each element in the row
-    for (int jx = 0; jx < sz; ++jx) {
-      // Perform Newton algorithm for each element
-      return_tuple values = newton_algorithm(reix[jx],imix[jx],degree);
-      attractor[jx] = values.root;
-      convergence[jx] = values.iter;
+  const void *re = thrd_info->re;
+  uint8_t *convergences = thrd_info->convergences;
+  uint8_t *attractors = thrd_info->attractors;
+  atomic_int *next_row = thrd_info->next_row;
+  const int width = thrd_info->width;
+  const int height = thrd_info->height;
+  row_sync_t *sync = thrd_info->sync;
+  const int n_bands = (height + band_rows - 1) / band_rows;
+  void *imix = malloc(width*coord_size());
+
+  // Scratch for the bands rendered by subdivision
+  subdiv_region_t region;
+  if (subdivide) {
+    subdiv_region_init(&region);
+    region.x0 = 0;
+    region.scale = 1;
+    region.stride = width;
+  }
+
+  // Take the next band of rows until all are taken, so threads that get fast
+  // rows take more of them and all threads finish together
+  for (int bx; (bx = atomic_fetch_add_explicit(next_row, 1, memory_order_relaxed)) < n_bands; ) {
+    const int y0 = bx * band_rows;
+    const int n_rows = height - y0 < band_rows ? height - y0 : band_rows;
+    // Wait for the slot of the band, only when the writer falls behind
+    row_reserve(sync, bx);
+    uint8_t *attractor = attractors + (size_t) (bx % sync->n_slots) * band_rows * width;
+    uint8_t *convergence = convergences + (size_t) (bx % sync->n_slots) * band_rows * width;
+
+    if (subdivide) {
+      region.y0 = y0;
+      region.attractors = attractor;
+      region.convergences = convergence;
+      subdiv_render(&region, width, n_rows);
     }
+    else {
+      for (int ix = y0; ix < y0 + n_rows; ++ix) {
+        // Imaginary part of the row, derived from its index
+        for (int jx = 0; jx < width; ++jx)
+          viewport_store(viewport.im_min, viewport.im_span, ix, height, imix, jx);
 
-    // Lock the mutex before updating shared data
-    mtx_lock(mtx); 
-    convergences[ix] = convergence;
-    attractors[ix] = attractor;
-    status[tx].val = ix + istep;
-    // Unlock the mutex after updating shared data
-    mtx_unlock(mtx);
-    // Signal the checker that a line is finished and can be checked
-    cnd_signal(cnd);
+        // Perform Newton algorithm for each element of the row
+        newton_row(re, imix, width, attractor + (size_t) (ix - y0) * width, convergence + (size_t) (ix - y0) * width);
+      }
+    }
+
+    // Tell the writer that the band can be written
+    row_publish(sync, bx);
   }
 
+  if (subdivide)
+    subdiv_region_free(&region);
+  free(imix);
   return 0;
 }
 
+// Function to convert n iteration counts to shades of grey, 128/color_max
+// per iteration. color_max comes from the first row, so larger counts further
+// down are clamped to white instead of wrapping around.
+static void convergence_shades(const uint8_t *convergence, int n, int color_max, uint8_t *shades)
+{
+  const int scale = 128/color_max;
+  for (int j = 0; j < n; j++) {
+    const int shade = scale*convergence[j];
+    shades[j] = shade < 255 ? shade : 255;
+  }
+}
+
 // Function to be executed by the check thread
 int main_thrd_write(void *args)
 {
   const thrd_info_check_t *thrd_info = (thrd_info_check_t*) args;
-  const float **im = thrd_info->im;
-  const float **re = thrd_info->re;
-  uint8_t **convergences = thrd_info->convergences;
-  uint8_t **attractors = thrd_info->attractors;
-  const int sz = thrd_info->sz;
-  const int n_threads = thrd_info->n_threads;
-  mtx_t *mtx = thrd_info->mtx;
-  cnd_t *cnd = thrd_info->cnd;
-  int_padded *status = thrd_info->status;
-  
+  uint8_t *convergences = thrd_info->convergences;
+  uint8_t *attractors = thrd_info->attractors;
+  const int width = thrd_info->width;
+  const int height = thrd_info->height;
+  row_sync_t *sync = thrd_info->sync;
+
   int color_max=-1;
-  char attractor_line_string[sz*color_string_length];
-  char convergence_line_string[sz*color_string_length];
+  uint8_t *shades = (uint8_t*) malloc(width*sizeof(uint8_t));
 
   // Open files for writing attractors and convergence data
   char name_file[26];
-  snprintf(name_file, sizeof(name_file), "newton_attractors_x%d.ppm", degree);
-  FILE* fp = fopen(name_file, "w");
-  fprintf(fp, "P3\n%i %i\n255\n", sz, sz);
-
-  snprintf(name_file, sizeof(name_file), "newton_convergence_x%d.ppm", degree);
-  FILE* fp2 = fopen(name_file, "w");
-  fprintf(fp2, "P3\n%i %i\n255\n", sz, sz);
-
-  // Loop until all lines are processed
-  for (int ix = 0, ibnd; ix < sz; ) {
-    // Wait until new lines are available
-    for (mtx_lock(mtx); ; ) {
-      ibnd = sz;
-      // Find the minimum of all status variables
-      for (int tx = 0; tx < n_threads; ++tx)
-        if (ibnd > status[tx].val)
-          ibnd = status[tx].val;
-
-      if (ibnd <= ix)
-        cnd_wait(cnd,mtx);
-      else {
-        mtx_unlock(mtx);
-        break;
-      }
+  const char *extension = output_format == format_png ? "png" : "ppm";
+  image_writer_t img, img2;
+  snprintf(name_file, sizeof(name_file), "newton_attractors_x%d.%s", degree, extension);
+  if (image_open(&img, name_file, output_format, width, height, root_encoding, 11) != 0)
+    exit(1);
+  snprintf(name_file, sizeof(name_file), "newton_convergence_x%d.%s", degree, extension);
+  if (image_open(&img2, name_file, output_format, width, height, (const char (*)[13]) convergence_colors, 256) != 0)
+    exit(1);
+
+  // Loop through the lines in order, waiting only for those not finished yet
+  for (int ix = 0; ix < height; ++ix) {
+    const int bx = ix / band_rows;
+    if (ix % band_rows == 0)
+      row_wait(sync, bx);
+    const size_t slot_line = (size_t) (bx % sync->n_slots) * band_rows + ix % band_rows;
+    const uint8_t *attractor = attractors + slot_line * width;
+    const uint8_t *convergence = convergences + slot_line * width;
+
+    // Find the maximum color value for normalization
+    for (int j = 0; j < width; j++){
+      if(convergence[j]>color_max && ix == 0)
+        color_max = convergence[j];
     }
+    // A zoom onto a root can converge at once on the whole first row
+    if (color_max < 1)
+      color_max = 1;
 
-    // Loop through the lines and process them
-    for (; ix < ibnd; ++ix) {
-      // Find the maximum color value for normalization
-      for (int j = 0; j < sz; j++){
-        if(convergences[ix][j]>color_max && ix == 0)
-          color_max = convergences[ix][j];
-      }
+    // Convert convergence data to shades of grey
+    convergence_shades(convergence, width, color_max, shades);
+    // Write attractor and convergence data to files
+    image_write_row(&img, attractor);
+    image_write_row(&img2, shades);
 
-      // Convert attractor and convergence data to color strings
-      for (int j = 0; j < sz; j++){
-        memcpy(attractor_line_string + j*color_string_length, root_encoding[attractors[ix][j]], color_string_length);
-        memcpy(convergence_line_string + j*color_string_length, convergence_colors[(128/color_max)*convergences[ix][j]], color_string_length);
+    // Hand the slot back for the band n_slots further on
+    if (ix % band_rows == band_rows - 1 || ix == height - 1)
+      row_release(sync, bx);
+  }
+  // Close files after writing
+  image_close(&img);
+  image_close(&img2);
+  free(shades);
+  return 0;
+}
+
+// Tile of the pyramid written with --tiles
+typedef struct {
+  int level;
+  int x; // column and row of the tile in its level
+  int y;
+  int width; // pixels, less than the tile size at the right and bottom edges
+  int height;
+  uint8_t *attractors; // pixels of the tile, kept with reuse until the tiles of the next level have used them
+  uint8_t *convergences;
+  int root; // root of every pixel, 0 if they differ or do not converge
+  atomic_int done; // the pixels are ready
+  atomic_int users; // tiles of the next level that have not used the pixels yet
+} tile_t;
+
+// Level of the pyramid. Every level has twice the resolution of the one
+// before, the last one that of the image.
+typedef struct {
+  int width; // pixels
+  int height;
+  int cols; // tiles
+  int rows;
+  int scale; // pixels of the image per pixel of the level along each axis
+  int first; // index of the first tile of the level
+} tile_level_t;
+
+// Pyramid of tiles rendered by the tile threads. Tiles are taken level by
+// level, so the tiles of the coarser level that a tile reuses are always
+// taken before it.
+typedef struct {
+  const char *dir;
+  int tile_size;
+  int n_levels;
+  tile_level_t *levels;
+  tile_t *tiles;
+  int n_tiles;
+  bool reuse; // fill tiles inside one root from the coarser level (--reuse)
+  int color_max; // normalization of the convergence, from the first row of the image
+  atomic_int next_tile; // next tile that no thread has taken yet
+  atomic_uint tiles_done; // tiles finished so far, the futex word threads sleep on for coarser tiles
+} tile_pyramid_t;
+
+// Function to set up the levels and tiles of a pyramid of the image, with
+// enough levels that the first fits in one tile unless n_levels is given
+static void tile_pyramid_init(tile_pyramid_t *p, const char *dir, int tile_size, int n_levels)
+{
+  p->dir = dir;
+  p->tile_size = tile_size;
+  if (n_levels < 1)
+    for (n_levels = 1; (width > height ? width : height) > (long) tile_size << (n_levels - 1); n_levels++);
+  p->n_levels = n_levels;
+  p->levels = (tile_level_t*) malloc(n_levels*sizeof(tile_level_t));
+  p->n_tiles = 0;
+  for (int lx = 0; lx < n_levels; ++lx) {
+    tile_level_t *level = &p->levels[lx];
+    level->scale = 1 << (n_levels - 1 - lx);
+    level->width = (width + level->scale - 1) / level->scale;
+    level->height = (height + level->scale - 1) / level->scale;
+    level->cols = (level->width + tile_size - 1) / tile_size;
+    level->rows = (level->height + tile_size - 1) / tile_size;
+    level->first = p->n_tiles;
+    p->n_tiles += level->cols * level->rows;
+  }
+  p->tiles = (tile_t*) malloc(p->n_tiles*sizeof(tile_t));
+  for (int lx = 0; lx < n_levels; ++lx) {
+    const tile_level_t *level = &p->levels[lx];
+    for (int ty = 0; ty < level->rows; ++ty)
+      for (int tx = 0; tx < level->cols; ++tx) {
+        tile_t *tile = &p->tiles[level->first + ty*level->cols + tx];
+        tile->level = lx;
+        tile->x = tx;
+        tile->y = ty;
+        tile->width = level->width - tx*tile_size < tile_size ? level->width - tx*tile_size : tile_size;
+        tile->height = level->height - ty*tile_size < tile_size ? level->height - ty*tile_size : tile_size;
+        tile->attractors = tile->convergences = NULL;
+        tile->root = 0;
+        atomic_init(&tile->done, 0);
+        int users = 0;
+        if (lx + 1 < n_levels) {
+          const tile_level_t *fine = &p->levels[lx + 1];
+          users = ((2*tx + 2 < fine->cols ? 2 : fine->cols - 2*tx) *
+                   (2*ty + 2 < fine->rows ? 2 : fine->rows - 2*ty));
+        }
+        atomic_init(&tile->users, users);
       }
-      // Write attractor and convergence data to files
-      fwrite(attractor_line_string, 1, sz*color_string_length,fp);
-      fwrite(convergence_line_string, 1, sz*color_string_length,fp2);
+  }
+  atomic_init(&p->next_tile, 0);
+  atomic_init(&p->tiles_done, 0);
+}
 
-      // Free memory allocated for attractor and convergence data
-      free(attractors[ix]);
-      free(convergences[ix]);
-    } 
+// Function to free the levels and tiles of a pyramid
+static void tile_pyramid_free(tile_pyramid_t *p)
+{
+  for (int k = 0; k < p->n_tiles; ++k) {
+    free(p->tiles[k].attractors);
+    free(p->tiles[k].convergences);
+  }
+  free(p->tiles);
+  free(p->levels);
+}
+
+// Function to compute a row or column of n pixels of a tile starting at its
+// pixel (jx, ix), at the resolution of its level
+static void tile_line(const tile_pyramid_t *p, const tile_t *tile, int jx, int ix, int dx, int dy, int n,
+                      void *re, void *im, uint8_t *attractors, uint8_t *convergences)
+{
+  const int scale = p->levels[tile->level].scale;
+  const int x0 = tile->x*p->tile_size, y0 = tile->y*p->tile_size;
+  for (int k = 0; k < n; ++k) {
+    viewport_store(viewport.re_min, viewport.re_span, (x0 + jx + k*dx)*scale, width, re, k);
+    viewport_store(viewport.im_min, viewport.im_span, (y0 + ix + k*dy)*scale, height, im, k);
+  }
+  newton_row(re, im, n, attractors, convergences);
+}
+
+// Function to fill a tile from the quarter of the coarser tile it covers when
+// that quarter and the border of the tile, computed first, are all one root,
+// as rectangles are filled by subdivision. Inside the border the iteration
+// counts are taken from the nearest coarser pixel, so the tile is approximate.
+// re, im and column hold tile_size values. Returns false if the tile has to be computed.
+static bool tile_fill(const tile_pyramid_t *p, const tile_t *tile, const tile_t *parent, uint8_t *attractors,
+                      uint8_t *convergences, void *re, void *im, uint8_t *column)
+{
+  const int w = tile->width, h = tile->height;
+  const int half = p->tile_size / 2;
+  const int x0 = (tile->x % 2)*half, y0 = (tile->y % 2)*half;
+  const uint8_t root = parent->attractors[y0*parent->width + x0];
+  if (root == 10)
+    return false;
+  for (int ix = 0; ix < h; ix += 2)
+    for (int jx = 0; jx < w; jx += 2)
+      if (parent->attractors[(y0 + ix/2)*parent->width + x0 + jx/2] != root)
+        return false;
+
+  // Top and bottom rows in place, left and right columns through column
+  for (int side = 0; side < 2; ++side) {
+    const int ix = side ? h - 1 : 0, jx = side ? w - 1 : 0;
+    tile_line(p, tile, 0, ix, 1, 0, w, re, im, attractors + ix*w, convergences + ix*w);
+    tile_line(p, tile, jx, 0, 0, 1, h, re, im, column, column + p->tile_size);
+    for (int k = 0; k < h; ++k) {
+      attractors[k*w + jx] = column[k];
+      convergences[k*w + jx] = column[p->tile_size + k];
+    }
+  }
+  for (int jx = 0; jx < w; ++jx)
+    if (attractors[jx] != root || attractors[(h - 1)*w + jx] != root)
+      return false;
+  for (int ix = 0; ix < h; ++ix)
+    if (attractors[ix*w] != root || attractors[ix*w + w - 1] != root)
+      return false;
+
+  for (int ix = 1; ix < h - 1; ++ix) {
+    memset(attractors + ix*w + 1, root, w - 2);
+    for (int jx = 1; jx < w - 1; ++jx)
+      convergences[ix*w + jx] = parent->convergences[(y0 + ix/2)*parent->width + x0 + jx/2];
+  }
+  return true;
+}
+
+// Function to fill a tile from the coarser level with tile_fill once the
+// coarser tile is done, and to free the coarser pixels after their last use
+static bool tile_inherit(tile_pyramid_t *p, const tile_t *tile, uint8_t *attractors, uint8_t *convergences,
+                         void *re, void *im, uint8_t *column)
+{
+  if (!p->reuse || tile->level == 0)
+    return false;
+  const tile_level_t *coarse = &p->levels[tile->level - 1];
+  tile_t *parent = &p->tiles[coarse->first + (tile->y / 2)*coarse->cols + tile->x / 2];
+
+  // Wait for the coarser tile, only at the start of a level
+  while (!atomic_load(&parent->done)) {
+    unsigned seen = atomic_load(&p->tiles_done);
+    if (atomic_load(&parent->done))
+      break;
+    futex_wait(&p->tiles_done, seen);
+  }
+
+  const bool filled = tile_fill(p, tile, parent, attractors, convergences, re, im, column);
+  if (atomic_fetch_sub(&parent->users, 1) == 1) {
+    free(parent->attractors);
+    free(parent->convergences);
+    parent->attractors = parent->convergences = NULL;
+  }
+  return filled;
+}
+
+// Function to compute the pixels of a tile, a strip per row or by subdivision
+// in region. re and im hold tile_size coordinates.
+static void tile_render(const tile_pyramid_t *p, const tile_t *tile, uint8_t *attractors, uint8_t *convergences,
+                        void *re, void *im, subdiv_region_t *region)
+{
+  const int scale = p->levels[tile->level].scale;
+  const int x0 = tile->x*p->tile_size, y0 = tile->y*p->tile_size;
+  if (subdivide) {
+    region->x0 = x0;
+    region->y0 = y0;
+    region->scale = scale;
+    region->attractors = attractors;
+    region->convergences = convergences;
+    region->stride = tile->width;
+    subdiv_render(region, tile->width, tile->height);
+    return;
+  }
+  for (int jx = 0; jx < tile->width; ++jx)
+    viewport_store(viewport.re_min, viewport.re_span, (x0 + jx)*scale, width, re, jx);
+  for (int ix = 0; ix < tile->height; ++ix) {
+    for (int jx = 0; jx < tile->width; ++jx)
+      viewport_store(viewport.im_min, viewport.im_span, (y0 + ix)*scale, height, im, jx);
+    newton_row(re, im, tile->width, attractors + ix*tile->width, convergences + ix*tile->width);
+  }
+}
+
+// Function to write both images of a tile as DIR/LEVEL/attractors_X_Y and
+// DIR/LEVEL/convergence_X_Y
+static void tile_write(const tile_pyramid_t *p, const tile_t *tile, const uint8_t *attractors,
+                       const uint8_t *convergences, uint8_t *shades)
+{
+  char path[4096];
+  const char *extension = output_format == format_png ? "png" : "ppm";
+  image_writer_t img, img2;
+  snprintf(path, sizeof(path), "%s/%d/attractors_%d_%d.%s", p->dir, tile->level, tile->x, tile->y, extension);
+  if (image_open(&img, path, output_format, tile->width, tile->height, root_encoding, 11) != 0)
+    exit(1);
+  snprintf(path, sizeof(path), "%s/%d/convergence_%d_%d.%s", p->dir, tile->level, tile->x, tile->y, extension);
+  if (image_open(&img2, path, output_format, tile->width, tile->height,
+                 (const char (*)[13]) convergence_colors, 256) != 0)
+    exit(1);
+  for (int ix = 0; ix < tile->height; ++ix) {
+    const uint8_t *convergence = convergences + ix*tile->width;
+    convergence_shades(convergence, tile->width, p->color_max, shades);
+    image_write_row(&img, attractors + ix*tile->width);
+    image_write_row(&img2, shades);
+  }
+  image_close(&img);
+  image_close(&img2);
+}
+
+// Function to be executed by tile threads
+int main_thrd_tiles(void *args)
+{
+  tile_pyramid_t *p = (tile_pyramid_t*) args;
+  const size_t tile_pixels = (size_t) p->tile_size*p->tile_size;
+  void *re = malloc(p->tile_size*coord_size());
+  void *im = malloc(p->tile_size*coord_size());
+  uint8_t *shades = (uint8_t*) malloc(p->tile_size*sizeof(uint8_t));
+  uint8_t *attractors = (uint8_t*) malloc(tile_pixels*sizeof(uint8_t));
+  uint8_t *convergences = (uint8_t*) malloc(tile_pixels*sizeof(uint8_t));
+  uint8_t *column = (uint8_t*) malloc(2*p->tile_size*sizeof(uint8_t));
+  subdiv_region_t region;
+  if (subdivide)
+    subdiv_region_init(&region);
+
+  // Take the next tile until all are taken, the coarsest first
+  for (int k; (k = atomic_fetch_add_explicit(&p->next_tile, 1, memory_order_relaxed)) < p->n_tiles; ) {
+    tile_t *tile = &p->tiles[k];
+    const size_t n = (size_t) tile->width*tile->height;
+    if (!tile_inherit(p, tile, attractors, convergences, re, im, column))
+      tile_render(p, tile, attractors, convergences, re, im, &region);
+
+    tile->root = attractors[0] == 10 ? 0 : attractors[0];
+    for (size_t jx = 1; jx < n && tile->root != 0; ++jx)
+      if (attractors[jx] != tile->root)
+        tile->root = 0;
+    tile_write(p, tile, attractors, convergences, shades);
+
+    // Keep the pixels for the next level and wake threads waiting for them
+    if (p->reuse && tile->level + 1 < p->n_levels) {
+      tile->attractors = (uint8_t*) malloc(n*sizeof(uint8_t));
+      tile->convergences = (uint8_t*) malloc(n*sizeof(uint8_t));
+      memcpy(tile->attractors, attractors, n);
+      memcpy(tile->convergences, convergences, n);
+      atomic_store(&tile->done, 1);
+      atomic_fetch_add(&p->tiles_done, 1);
+      futex_wake(&p->tiles_done, INT32_MAX);
+    }
+  }
+
+  free(re);
+  free(im);
+  free(shades);
+  free(attractors);
+  free(convergences);
+  free(column);
+  if (subdivide)
+    subdiv_region_free(&region);
+  return 0;
+}
+
+// Function to render the image as a pyramid of tiles into dir, with one
+// directory per level and an index of the levels and tiles
+static int render_tiles(const char *dir, int tile_size, int n_levels, bool reuse)
+{
+  tile_pyramid_t p;
+  tile_pyramid_init(&p, dir, tile_size, n_levels);
+  p.reuse = reuse;
+
+  // Directories of the levels
+  char path[4096];
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror("Error creating tile directory");
+    return 1;
+  }
+  for (int lx = 0; lx < p.n_levels; ++lx) {
+    snprintf(path, sizeof(path), "%s/%d", dir, lx);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      perror("Error creating tile directory");
+      return 1;
+    }
+  }
+
+  // The convergence is shaded as in the single image, from its first row
+  {
+    void *re = malloc(width*coord_size());
+    void *im = malloc(width*coord_size());
+    uint8_t *attractor = (uint8_t*) malloc(width*sizeof(uint8_t));
+    uint8_t *convergence = (uint8_t*) malloc(width*sizeof(uint8_t));
+    for (int jx = 0; jx < width; ++jx) {
+      viewport_store(viewport.re_min, viewport.re_span, jx, width, re, jx);
+      viewport_store(viewport.im_min, viewport.im_span, 0, height, im, jx);
+    }
+    newton_row(re, im, width, attractor, convergence);
+    p.color_max = -1;
+    for (int j = 0; j < width; j++)
+      if (convergence[j] > p.color_max)
+        p.color_max = convergence[j];
+    if (p.color_max < 1)
+      p.color_max = 1;
+    free(re);
+    free(im);
+    free(attractor);
+    free(convergence);
+  }
+
+  // Tiles are independent units of work, taken by the threads as they become free
+  thrd_t thrds[n_threads];
+  for (int tx = 0; tx < n_threads; ++tx) {
+    int r = thrd_create(thrds + tx, main_thrd_tiles, (void*) &p);
+    if (r != thrd_success) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  for (int tx = 0; tx < n_threads; ++tx) {
+    int r;
+    thrd_join(thrds[tx], &r);
+  }
+
+  // Index: the region and format, a line per level and a line per tile with
+  // the root of all its pixels, or 0
+  snprintf(path, sizeof(path), "%s/index.txt", dir);
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("Error opening tile index");
+    return 1;
+  }
+  fprintf(fp, "degree %d\n", degree);
+  fprintf(fp, "format %s\n", output_format == format_png ? "png" : output_format == format_p6 ? "p6" : "p3");
+  fprintf(fp, "region %.17g %.17g %.17g %.17g %.17g %.17g\n", viewport.re_min.hi, viewport.re_min.lo,
+          viewport.im_min.hi, viewport.im_min.lo, viewport.re_span, viewport.im_span);
+  fprintf(fp, "tile_size %d\n", p.tile_size);
+  fprintf(fp, "levels %d\n", p.n_levels);
+  for (int lx = 0; lx < p.n_levels; ++lx)
+    fprintf(fp, "level %d %d %d %d %d\n", lx, p.levels[lx].width, p.levels[lx].height,
+            p.levels[lx].cols, p.levels[lx].rows);
+  for (int k = 0; k < p.n_tiles; ++k) {
+    const tile_t *tile = &p.tiles[k];
+    fprintf(fp, "tile %d %d %d %d %d %d\n", tile->level, tile->x, tile->y, tile->width, tile->height, tile->root);
   }
-  // Close files after writing
   fclose(fp);
+
+  tile_pyramid_free(&p);
   return 0;
 }
 
@@ -248,83 +875,215 @@ int main(int argc, char*argv[])
 {
     // Parsing command line arguments
     int opt;
-    while((opt = getopt(argc, argv, "t: l:")) != -1){
+    const char* kernel_name = NULL;
+    bool by_center = false; // the viewport is given by --center and --span
+    dd_t center_re = {0., 0.}, center_im = {0., 0.};
+    double span = 4.;
+    bool format_given = false;
+    bool thread_given = false;
+    const char* tiles_dir = NULL; // write a pyramid of tiles instead of two images
+    int tile_size = 256, n_levels = 0;
+    bool reuse = false;
+    enum { opt_center = 256, opt_span, opt_width, opt_height, opt_precision, opt_tiles, opt_tile_size,
+           opt_levels, opt_reuse, opt_subdivide };
+    static const struct option long_options[] = {
+        {"center", required_argument, NULL, opt_center},
+        {"span", required_argument, NULL, opt_span},
+        {"width", required_argument, NULL, opt_width},
+        {"height", required_argument, NULL, opt_height},
+        {"precision", required_argument, NULL, opt_precision},
+        {"tiles", required_argument, NULL, opt_tiles},
+        {"tile-size", required_argument, NULL, opt_tile_size},
+        {"levels", required_argument, NULL, opt_levels},
+        {"reuse", no_argument, NULL, opt_reuse},
+        {"subdivide", no_argument, NULL, opt_subdivide},
+        {NULL, 0, NULL, 0}
+    };
+    while((opt = getopt_long(argc, argv, "t: l: k: f: r:", long_options, NULL)) != -1){
         switch(opt){
             case 't':
+                // Number of computation threads, by default one per online CPU as far as there are rows
                 n_threads = atoi(optarg);
+                thread_given = true;
                 break;
             case 'l':
-                sz = atoi(optarg);
+                // Square image of this many rows and cols
+                width = height = atoi(optarg);
+                break;
+            case 'k':
+                // Force a strip kernel (scalar, avx2, avx512) instead of detecting the widest one
+                kernel_name = optarg;
+                break;
+            case 'f':
+                // Format of the images: ASCII (p3, default) or binary (p6) PPM, or indexed PNG (png)
+                output_format = strcmp(optarg, "png") == 0 ? format_png :
+                                strcmp(optarg, "p6") == 0 ? format_p6 : format_p3;
+                format_given = true;
+                break;
+            case 'r': {
+                // Region of the plane as RE_MIN,RE_MAX,IM_MIN,IM_MAX, rows go from IM_MIN to IM_MAX
+                double re_max, im_max;
+                if (sscanf(optarg, "%lf,%lf,%lf,%lf", &viewport.re_min.hi, &re_max, &viewport.im_min.hi, &im_max) != 4){
+                    printf("The region must be given as RE_MIN,RE_MAX,IM_MIN,IM_MAX \n");
+                    return 0;
+                }
+                viewport.re_span = re_max - viewport.re_min.hi;
+                viewport.im_span = im_max - viewport.im_min.hi;
+                by_center = false;
+                break;
+            }
+            case opt_center: {
+                // Center of the region as RE,IM, read to double-double for deep zooms
+                const char *end = dd_parse(optarg, &center_re);
+                if (end == optarg || *end != ',' || *dd_parse(end + 1, &center_im) != '\0'){
+                    printf("The center must be given as RE,IM \n");
+                    return 0;
+                }
+                by_center = true;
+                break;
+            }
+            case opt_span:
+                // Width of the region along the real axis, the pixels are square
+                span = atof(optarg);
+                by_center = true;
+                break;
+            case opt_width:
+                width = atoi(optarg);
+                break;
+            case opt_height:
+                height = atoi(optarg);
+                break;
+            case opt_precision:
+                // Force the precision (float, double, dd) instead of picking it from the zoom
+                precision = strcmp(optarg, "dd") == 0 ? precision_dd :
+                            strcmp(optarg, "double") == 0 ? precision_double : precision_float;
+                break;
+            case opt_tiles:
+                // Directory to write the image to as tiles at several levels of resolution, PNG by default
+                tiles_dir = optarg;
+                break;
+            case opt_tile_size:
+                // Pixels along each side of a tile, even
+                tile_size = atoi(optarg);
+                break;
+            case opt_levels:
+                // Number of levels, by default enough that the coarsest is a single tile
+                n_levels = atoi(optarg);
+                break;
+            case opt_reuse:
+                // Fill tiles inside one root on the coarser level and on their own border without
+                // iterating inside, approximate as their iteration counts come from the coarser level
+                reuse = true;
+                break;
+            case opt_subdivide:
+                // Fill rectangles whose border converges to one root without iterating inside,
+                // their iteration counts are interpolated from the border
+                subdivide = true;
+                band_rows = subdivide_band_rows;
                 break;
             default:
                 break;
         }
     }
-    if (argv[3] != NULL){
+    if (optind < argc){
         degree = atoi(argv[argc-1]);
     }
     else{
         printf("No exponent degree was given \n");
         return 0;
     }
+    if (degree < 1 || degree > 9){
+        printf("The exponent degree must be between 1 and 9 \n");
+        return 0;
+    }
+    if (width < 1 || height < 1){
+        printf("The image must have at least one row and col \n");
+        return 0;
+    }
+    if (by_center){
+        viewport.re_span = span;
+        viewport.im_span = span * height / width;
+        viewport.re_min = dd_add_d(center_re, -0.5 * viewport.re_span);
+        viewport.im_min = dd_add_d(center_im, -0.5 * viewport.im_span);
+    }
+    if (!(viewport.re_span > 0 && viewport.im_span > 0)){
+        printf("The region must have a positive size \n");
+        return 0;
+    }
+
+    if (tiles_dir != NULL && (tile_size < 2 || tile_size % 2 != 0 || n_levels > 24)){
+        printf("The tile size must be even and there can be at most 24 levels \n");
+        return 0;
+    }
+
+    if (!thread_given){
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus < 1 ? 1 : n_cpus < height ? (int) n_cpus : height;
+    }
+    if (n_threads < 1){
+        printf("There must be at least one thread \n");
+        return 0;
+    }
 
     // Check if the number of threads exceeds the number of rows
-    if(n_threads>sz){
+    if(n_threads>height){
       printf("You can't have more threads than the number of rows in the picture");
       return 0;
     }
-    printf("Number of threads:%i, Number of rows and cols: %i, exponent of x^: %i \n", n_threads, sz, degree);
-
-    // Allocate memory for arrays
-    float **re = (float**) malloc(sz*sizeof(float*));
-    float **im = (float**) malloc(sz*sizeof(float*));
-        uint8_t **attractors = (uint8_t**) malloc(sz*sizeof(uint8_t*));
-    uint8_t **convergences = (uint8_t**) malloc(sz*sizeof(uint8_t*));
-    float *reentries = (float*) malloc(sz*sz*sizeof(float));
-    float *imentries = (float*) malloc(sz*sz*sizeof(float));
-
-    // Assign memory for the 2D arrays
-    for (int ix = 0, jx = 0; ix < sz; ++ix, jx += sz) {
-        re[ix] = reentries + jx;
-        im[ix] = imentries + jx;
-    }
+    printf("Number of threads:%i, Number of rows: %i, cols: %i, exponent of x^: %i \n", n_threads, height, width, degree);
+    if (precision < 0)
+        precision = viewport_precision();
+    if (precision == precision_float)
+        newton_strip = select_newton_strip(kernel_name, degree);
+    else
+        newton_deep_strip = select_newton_deep_strip(kernel_name, precision, degree);
 
-    // Initialize the complex plane
-    for (int ire = 0; ire < sz; ire++) {
-        for (int iim = 0; iim < sz; iim++) {
-            re[iim][ire] = ((float)ire) / ((float) sz) * 4.f - 2.f;
-            im[iim][ire] = ((float)iim) / ((float) sz) * 4.f - 2.f;
-        }
+    if (tiles_dir != NULL){
+        if (!format_given)
+            output_format = format_png;
+        return render_tiles(tiles_dir, tile_size, n_levels, reuse);
     }
 
+    // Real parts of the columns, the threads derive the imaginary part of each row
+    void *re = malloc(width*coord_size());
+    for (int ire = 0; ire < width; ire++)
+        viewport_store(viewport.re_min, viewport.re_span, ire, width, re, ire);
+
     thrd_t thrds[n_threads];
     thrd_info_t thrds_info[n_threads];
 
     thrd_t thrd_check;
     thrd_info_check_t thrd_info_check;
 
-    mtx_t mtx;
-    mtx_init(&mtx, mtx_plain);
+    // Ring of rows in flight, a few per thread so that the writer can fall
+    // behind briefly without stalling the computation threads. Bands of
+    // subdivision are large enough that one per thread and one for the
+    // writer suffice. No row is finished yet.
+    row_sync_t sync;
+    const int n_bands = (height + band_rows - 1) / band_rows;
+    const int slots_wanted = band_rows > 1 ? n_threads + 1 : rows_in_flight * n_threads;
+    sync.n_slots = slots_wanted < n_bands ? slots_wanted : n_bands;
+    sync.slot_row = (atomic_int*) malloc(sync.n_slots*sizeof(atomic_int));
+    for (int slot = 0; slot < sync.n_slots; ++slot)
+        atomic_init(&sync.slot_row[slot], -1);
+    atomic_init(&sync.finished, 0);
+    atomic_init(&sync.writer_waiting, 0);
+    atomic_init(&sync.written, 0);
+    atomic_init(&sync.workers_waiting, 0);
+    uint8_t *attractors = (uint8_t*) malloc((size_t) sync.n_slots*band_rows*width*sizeof(uint8_t));
+    uint8_t *convergences = (uint8_t*) malloc((size_t) sync.n_slots*band_rows*width*sizeof(uint8_t));
 
-    cnd_t cnd;
-    cnd_init(&cnd);
-
-    int_padded status[n_threads];
+    atomic_int next_row = 0;
 
     // Compute attractors and convergence using multiple threads
     for (int tx = 0; tx < n_threads; ++tx) {
-        thrds_info[tx].im = (const float**) im;
-        thrds_info[tx].re = (const float**) re;
+        thrds_info[tx].re = re;
         thrds_info[tx].convergences = convergences;
         thrds_info[tx].attractors = attractors;
-        thrds_info[tx].ib = tx;
-        thrds_info[tx].istep = n_threads; // Each thread processes its own set of rows
-        thrds_info[tx].sz = sz;
-        thrds_info[tx].tx = tx;
-        thrds_info[tx].mtx = &mtx;
-        thrds_info[tx].cnd = &cnd;
-        thrds_info[tx].status = status;
-        status[tx].val = -1;
+        thrds_info[tx].next_row = &next_row; // Threads take rows as they become free
+        thrds_info[tx].width = width;
+        thrds_info[tx].height = height;
+        thrds_info[tx].sync = &sync;
 
         int r = thrd_create(thrds + tx, main_thrd, (void*) (thrds_info + tx));
         if (r != thrd_success) {
@@ -336,16 +1095,11 @@ int main(int argc, char*argv[])
 
     // Launch a thread to check computation and free allocated memory
     {
-        thrd_info_check.im = (const float**) im;
-        thrd_info_check.re = (const float**) re;
         thrd_info_check.convergences = convergences;
         thrd_info_check.attractors = attractors;
-        thrd_info_check.sz = sz;
-        thrd_info_check.n_threads = n_threads;
-        thrd_info_check.mtx = &mtx;
-        thrd_info_check.cnd = &cnd;
-        // Initialize status in the previous loop since it will be used by the check thread
-        thrd_info_check.status = status;
+        thrd_info_check.width = width;
+        thrd_info_check.height = height;
+        thrd_info_check.sync = &sync;
 
         int r = thrd_create(&thrd_check, main_thrd_write, (void*) (&thrd_info_check));
         if (r != thrd_success) {
@@ -361,16 +1115,10 @@ int main(int argc, char*argv[])
     }
 
     // Free allocated memory
-    free(reentries);
-    free(imentries);
     free(re);
-    free(im);
     free(attractors);
     free(convergences);
-
-    // Destroy mutex and conditional variable
-    mtx_destroy(&mtx);
-    cnd_destroy(&cnd);
+    free(sync.slot_row);
 
     return 0;
 }
@@ -0,0 +1,486 @@
+#ifndef NEWTON_DEEP_KERNELS_H
+#define NEWTON_DEEP_KERNELS_H
+
+#include "newton_kernels.h"
+
+// Strip kernels in double and double-double precision, for views zoomed in
+// beyond the resolution of float. Both take their points as double-double,
+// the double kernels round them to double.
+
+// Lanes of the deep strip kernels. Every step works on all lanes at once,
+// as vectors of the vector extension of GCC (see deep_vec_t).
+#define DEEP_LANES 8
+
+// Precisions of the coordinates and of the iteration
+enum {
+  precision_float,  // the float strip kernels of newton_kernels.h
+  precision_double, // 53 bits
+  precision_dd      // double-double, about 106 bits
+};
+
+// Double-double number hi + lo, with lo at most half an ulp of hi
+typedef struct {
+  double hi;
+  double lo;
+} dd_t;
+
+// Strip kernel of a deep precision, see newton_strip_t
+typedef void (*newton_deep_strip_t)(const dd_t*, const dd_t*, int, uint8_t*, uint8_t*);
+
+// Function to add two doubles with |a| >= |b| exactly into a double-double
+static inline __attribute__((always_inline))
+dd_t quick_two_sum(double a, double b)
+{
+  double s = a + b;
+  return (dd_t){s, b - (s - a)};
+}
+
+// Function to add two doubles exactly into a double-double
+static inline __attribute__((always_inline))
+dd_t two_sum(double a, double b)
+{
+  double s = a + b;
+  double bb = s - a;
+  return (dd_t){s, (a - (s - bb)) + (b - bb)};
+}
+
+// Function to multiply two doubles exactly into a double-double. The halves
+// of the Dekker split multiply without rounding, which needs -ffp-contract=off
+static inline __attribute__((always_inline))
+dd_t two_prod(double a, double b)
+{
+  double p = a * b;
+  double ta = 134217729.0 * a, tb = 134217729.0 * b; // 2^27 + 1
+  double ah = ta - (ta - a), al = a - ah;
+  double bh = tb - (tb - b), bl = b - bh;
+  return (dd_t){p, ((ah * bh - p) + ah * bl + al * bh) + al * bl};
+}
+
+// Function to add two double-doubles
+static inline __attribute__((always_inline))
+dd_t dd_add(dd_t a, dd_t b)
+{
+  dd_t s = two_sum(a.hi, b.hi);
+  dd_t t = two_sum(a.lo, b.lo);
+  s = quick_two_sum(s.hi, s.lo + t.hi);
+  return quick_two_sum(s.hi, s.lo + t.lo);
+}
+
+// Function to subtract two double-doubles
+static inline __attribute__((always_inline))
+dd_t dd_sub(dd_t a, dd_t b)
+{
+  return dd_add(a, (dd_t){-b.hi, -b.lo});
+}
+
+// Function to add a double to a double-double
+static inline __attribute__((always_inline))
+dd_t dd_add_d(dd_t a, double b)
+{
+  dd_t s = two_sum(a.hi, b);
+  return quick_two_sum(s.hi, s.lo + a.lo);
+}
+
+// Function to multiply a double-double by a double
+static inline __attribute__((always_inline))
+dd_t dd_mul_d(dd_t a, double b)
+{
+  dd_t p = two_prod(a.hi, b);
+  return quick_two_sum(p.hi, p.lo + a.lo * b);
+}
+
+// Function to divide a double-double by a double
+static inline __attribute__((always_inline))
+dd_t dd_div_d(dd_t a, double b)
+{
+  double q1 = a.hi / b;
+  dd_t r = dd_sub(a, two_prod(q1, b));
+  return quick_two_sum(q1, r.hi / b);
+}
+
+// Function to parse a decimal number like strtod, but to double-double.
+// Returns the first character after the number, or s if there is none.
+static const char* dd_parse(const char* s, dd_t* out)
+{
+  const char* c = s;
+  bool negative = *c == '-';
+  if (*c == '-' || *c == '+')
+    c++;
+  dd_t v = {0., 0.};
+  int n_digits = 0, exponent = 0;
+  bool point = false;
+  for (;; c++) {
+    if (*c == '.' && !point) {
+      point = true;
+      continue;
+    }
+    if (*c < '0' || *c > '9')
+      break;
+    v = dd_add_d(dd_mul_d(v, 10.), *c - '0');
+    exponent -= point;
+    n_digits++;
+  }
+  if (n_digits == 0)
+    return s;
+  if (*c == 'e' || *c == 'E') {
+    char* end;
+    long e = strtol(c + 1, &end, 10);
+    if (end != c + 1) {
+      exponent += (int) e;
+      c = end;
+    }
+  }
+  // Powers of ten up to 10^22 are exact in double
+  for (; exponent > 0; exponent -= exponent > 22 ? 22 : exponent)
+    v = dd_mul_d(v, pow(10., exponent > 22 ? 22 : exponent));
+  for (; exponent < 0; exponent += exponent < -22 ? 22 : -exponent)
+    v = dd_div_d(v, pow(10., exponent < -22 ? 22 : -exponent));
+  *out = negative ? (dd_t){-v.hi, -v.lo} : v;
+  return c;
+}
+
+// Lanes of the deep strip kernels as vectors of GCC's vector extension: one
+// zmm register with avx512, two ymm with avx2 and four xmm otherwise
+typedef double deep_vec_t __attribute__((vector_size(DEEP_LANES * sizeof(double))));
+typedef int64_t deep_mask_t __attribute__((vector_size(DEEP_LANES * sizeof(int64_t))));
+typedef uint64_t deep_bits_t __attribute__((vector_size(DEEP_LANES * sizeof(uint64_t))));
+
+// Double-doubles of all lanes
+typedef struct {
+  deep_vec_t hi;
+  deep_vec_t lo;
+} dd_vec_t;
+
+// Function to get a vector with v in every lane
+static inline __attribute__((always_inline))
+deep_vec_t deep_set1(double v)
+{
+  return (deep_vec_t){0.} + v;
+}
+
+// Function to get -1 in the lanes where a < b and 0 in the others. GCC splits
+// comparisons of vectors wider than the target into scalar ones, but not the
+// sign of the difference, which is only zero when a == b.
+static inline __attribute__((always_inline))
+deep_mask_t deep_less(deep_vec_t a, deep_vec_t b)
+{
+  return -(deep_mask_t) ((deep_bits_t) (a - b) >> 63);
+}
+
+// Functions on the double-doubles of all lanes, as their scalar counterparts
+static inline __attribute__((always_inline))
+dd_vec_t ddv_quick_two_sum(deep_vec_t a, deep_vec_t b)
+{
+  deep_vec_t s = a + b;
+  return (dd_vec_t){s, b - (s - a)};
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_two_sum(deep_vec_t a, deep_vec_t b)
+{
+  deep_vec_t s = a + b;
+  deep_vec_t bb = s - a;
+  return (dd_vec_t){s, (a - (s - bb)) + (b - bb)};
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_two_prod(deep_vec_t a, deep_vec_t b)
+{
+  deep_vec_t p = a * b;
+  deep_vec_t ta = 134217729.0 * a, tb = 134217729.0 * b;
+  deep_vec_t ah = ta - (ta - a), al = a - ah;
+  deep_vec_t bh = tb - (tb - b), bl = b - bh;
+  return (dd_vec_t){p, ((ah * bh - p) + ah * bl + al * bh) + al * bl};
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_add(dd_vec_t a, dd_vec_t b)
+{
+  dd_vec_t s = ddv_two_sum(a.hi, b.hi);
+  dd_vec_t t = ddv_two_sum(a.lo, b.lo);
+  s = ddv_quick_two_sum(s.hi, s.lo + t.hi);
+  return ddv_quick_two_sum(s.hi, s.lo + t.lo);
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_sub(dd_vec_t a, dd_vec_t b)
+{
+  return ddv_add(a, (dd_vec_t){-b.hi, -b.lo});
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_mul(dd_vec_t a, dd_vec_t b)
+{
+  dd_vec_t p = ddv_two_prod(a.hi, b.hi);
+  return ddv_quick_two_sum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_mul_d(dd_vec_t a, double b)
+{
+  dd_vec_t p = ddv_two_prod(a.hi, deep_set1(b));
+  return ddv_quick_two_sum(p.hi, p.lo + a.lo * b);
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_mul_v(dd_vec_t a, deep_vec_t b)
+{
+  dd_vec_t p = ddv_two_prod(a.hi, b);
+  return ddv_quick_two_sum(p.hi, p.lo + a.lo * b);
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_div(dd_vec_t a, dd_vec_t b)
+{
+  deep_vec_t q1 = a.hi / b.hi;
+  dd_vec_t r = ddv_sub(a, ddv_mul_v(b, q1));
+  return ddv_quick_two_sum(q1, r.hi / b.hi);
+}
+
+static inline __attribute__((always_inline))
+dd_vec_t ddv_div_d(dd_vec_t a, double b)
+{
+  deep_vec_t q1 = a.hi / b;
+  dd_vec_t r = ddv_sub(a, ddv_two_prod(q1, deep_set1(b)));
+  return ddv_quick_two_sum(q1, r.hi / b);
+}
+
+// Function to perform the Newton step in double on all lanes, z*(d-1)/d + w^(d-1)/d with w = 1/z
+static inline __attribute__((always_inline))
+void newton_step_double(const int degree, deep_vec_t* x, deep_vec_t* y)
+{
+  if (degree == 1) {
+    *x = deep_set1(1.);
+    *y = deep_set1(0.);
+    return;
+  }
+  // One division per step, vector division has the throughput of scalar division
+  deep_vec_t inv = 1. / (*x * *x + *y * *y);
+  deep_vec_t wre = *x * inv, wim = -*y * inv;
+  deep_vec_t pre = wre, pim = wim, t;
+  for (int k = 2; k < degree; k++) {
+    t = pre*wre - pim*wim;
+    pim = pre*wim + pim*wre;
+    pre = t;
+  }
+  *x = *x * ((degree - 1.) / degree) + pre * (1. / degree);
+  *y = *y * ((degree - 1.) / degree) + pim * (1. / degree);
+}
+
+// Function to perform the Newton step in double-double on all lanes, as newton_step_double
+static inline __attribute__((always_inline))
+void newton_step_dd(const int degree, dd_vec_t* x, dd_vec_t* y)
+{
+  if (degree == 1) {
+    *x = (dd_vec_t){deep_set1(1.), deep_set1(0.)};
+    *y = (dd_vec_t){deep_set1(0.), deep_set1(0.)};
+    return;
+  }
+  dd_vec_t one = {deep_set1(1.), deep_set1(0.)};
+  dd_vec_t inv = ddv_div(one, ddv_add(ddv_mul(*x, *x), ddv_mul(*y, *y)));
+  dd_vec_t wre = ddv_mul(*x, inv), wim = ddv_mul((dd_vec_t){-y->hi, -y->lo}, inv);
+  dd_vec_t pre = wre, pim = wim, t;
+  for (int k = 2; k < degree; k++) {
+    t = ddv_sub(ddv_mul(pre, wre), ddv_mul(pim, wim));
+    pim = ddv_add(ddv_mul(pre, wim), ddv_mul(pim, wre));
+    pre = t;
+  }
+  *x = ddv_div_d(ddv_add(ddv_mul_d(*x, degree - 1.), pre), degree);
+  *y = ddv_div_d(ddv_add(ddv_mul_d(*y, degree - 1.), pim), degree);
+}
+
+// Lanes of a deep strip kernel, retired and refilled like newton_lanes_t.
+// The low parts stay zero in double precision.
+typedef struct {
+  deep_vec_t x;
+  deep_vec_t y;
+  deep_vec_t x_lo;
+  deep_vec_t y_lo;
+  deep_mask_t iter;
+  deep_mask_t root;
+  int pixel[DEEP_LANES];
+  unsigned active;
+  int next;
+} newton_deep_lanes_t;
+
+// Function to load point next of the strip into lane k
+static inline
+void newton_deep_lanes_load(newton_deep_lanes_t* l, int k, const dd_t* re, const dd_t* im, bool dd)
+{
+  l->pixel[k] = l->next;
+  l->x[k] = re[l->next].hi;
+  l->y[k] = im[l->next].hi;
+  l->x_lo[k] = dd ? re[l->next].lo : 0.;
+  l->y_lo[k] = dd ? im[l->next].lo : 0.;
+  l->iter[k] = 0;
+  l->next++;
+}
+
+// Function to start the first points of a strip
+static inline
+void newton_deep_lanes_init(newton_deep_lanes_t* l, const dd_t* re, const dd_t* im, int n, bool dd)
+{
+  l->active = 0;
+  l->next = 0;
+  for (int k = 0; k < DEEP_LANES; k++) {
+    l->x[k] = l->y[k] = l->x_lo[k] = l->y_lo[k] = 0.;
+    l->iter[k] = 0;
+    if (l->next < n) {
+      newton_deep_lanes_load(l, k, re, im, dd);
+      l->active |= 1u << k;
+    }
+  }
+}
+
+// Function to write out the lanes in done and refill them from the strip
+static inline
+void newton_deep_lanes_retire(newton_deep_lanes_t* l, unsigned done, const dd_t* re, const dd_t* im, int n,
+                              uint8_t* roots, uint8_t* iters, bool dd)
+{
+  for (; done != 0; done &= done - 1) {
+    int k = __builtin_ctz(done);
+    roots[l->pixel[k]] = (uint8_t) l->root[k];
+    iters[l->pixel[k]] = (uint8_t) l->iter[k];
+    if (l->next < n)
+      newton_deep_lanes_load(l, k, re, im, dd);
+    else
+      l->active &= ~(1u << k);
+  }
+}
+
+// Function to find which of the active lanes at (x, y) are done, as in
+// newton_algorithm, and their roots. The tests only need the high parts.
+static inline __attribute__((always_inline))
+unsigned newton_deep_lanes_done(deep_vec_t x, deep_vec_t y, deep_mask_t iter, unsigned active,
+                                deep_mask_t* roots, const int degree)
+{
+  const deep_vec_t bnd = deep_set1((double) upper_bnd);
+  deep_mask_t stop = deep_less(bnd, x) | deep_less(x, -bnd) | deep_less(bnd, y) | deep_less(y, -bnd) |
+                     deep_less(x*x + y*y, deep_set1(lower_bnd_squared)) |
+                     -(deep_mask_t) ((deep_bits_t) (max_iter - 1 - iter) >> 63);
+  deep_mask_t found = stop;
+  deep_mask_t root = (deep_mask_t){0} + 10;
+  for (int j = degree - 1; j >= 0; j--) {
+    deep_vec_t dre = x - (double) root_solutions[degree-1][j][0];
+    deep_vec_t dim = y - (double) root_solutions[degree-1][j][1];
+    deep_mask_t hit = deep_less(dre*dre + dim*dim, deep_set1(root_tol_squared));
+    root = (hit & (j + 1)) | (~hit & root);
+    found |= hit;
+  }
+  *roots = (stop & 10) | (~stop & root);
+  unsigned done = 0;
+  for (int k = 0; k < DEEP_LANES; k++)
+    done |= (unsigned) (found[k] & 1) << k;
+  return done & active;
+}
+
+// Function to iterate a strip in double. The lanes stay in registers and only
+// go through memory to retire and refill.
+static inline __attribute__((always_inline))
+void newton_strip_double_of(const dd_t* re, const dd_t* im, int n, uint8_t* roots, uint8_t* iters,
+                            const int degree)
+{
+  newton_deep_lanes_t l;
+  newton_deep_lanes_init(&l, re, im, n, false);
+  deep_vec_t x = l.x, y = l.y;
+  deep_mask_t iter = l.iter;
+  while (l.active != 0) {
+    unsigned done = newton_deep_lanes_done(x, y, iter, l.active, &l.root, degree);
+    if (done != 0) {
+      l.x = x;
+      l.y = y;
+      l.iter = iter;
+      newton_deep_lanes_retire(&l, done, re, im, n, roots, iters, false);
+      x = l.x;
+      y = l.y;
+      iter = l.iter;
+      continue;
+    }
+    newton_step_double(degree, &x, &y);
+    iter += 1;
+  }
+}
+
+// Function to iterate a strip in double-double, as newton_strip_double_of
+static inline __attribute__((always_inline))
+void newton_strip_dd_of(const dd_t* re, const dd_t* im, int n, uint8_t* roots, uint8_t* iters,
+                        const int degree)
+{
+  newton_deep_lanes_t l;
+  newton_deep_lanes_init(&l, re, im, n, true);
+  dd_vec_t x = {l.x, l.x_lo}, y = {l.y, l.y_lo};
+  deep_mask_t iter = l.iter;
+  while (l.active != 0) {
+    unsigned done = newton_deep_lanes_done(x.hi, y.hi, iter, l.active, &l.root, degree);
+    if (done != 0) {
+      l.x = x.hi;
+      l.x_lo = x.lo;
+      l.y = y.hi;
+      l.y_lo = y.lo;
+      l.iter = iter;
+      newton_deep_lanes_retire(&l, done, re, im, n, roots, iters, true);
+      x = (dd_vec_t){l.x, l.x_lo};
+      y = (dd_vec_t){l.y, l.y_lo};
+      iter = l.iter;
+      continue;
+    }
+    newton_step_dd(degree, &x, &y);
+    iter += 1;
+  }
+}
+
+// Deep strip kernels specialized for each degree and instruction set, like
+// the float ones. The same code is compiled for every target.
+#define DEFINE_NEWTON_DEEP_STRIP(d, isa, target) \
+  target static void newton_strip_double_##isa##_##d(const dd_t* re, const dd_t* im, int n, \
+                                                      uint8_t* roots, uint8_t* iters) \
+  { newton_strip_double_of(re, im, n, roots, iters, d); } \
+  target static void newton_strip_dd_##isa##_##d(const dd_t* re, const dd_t* im, int n, \
+                                                  uint8_t* roots, uint8_t* iters) \
+  { newton_strip_dd_of(re, im, n, roots, iters, d); }
+#ifdef HAVE_X86_KERNELS
+#define DEFINE_NEWTON_DEEP_STRIPS(d) \
+  DEFINE_NEWTON_DEEP_STRIP(d, scalar, ) \
+  DEFINE_NEWTON_DEEP_STRIP(d, avx2, __attribute__((target("avx2")))) \
+  DEFINE_NEWTON_DEEP_STRIP(d, avx512, __attribute__((target("avx512f"))))
+#else
+#define DEFINE_NEWTON_DEEP_STRIPS(d) DEFINE_NEWTON_DEEP_STRIP(d, scalar, )
+#endif
+DEFINE_NEWTON_DEEP_STRIPS(1)
+DEFINE_NEWTON_DEEP_STRIPS(2)
+DEFINE_NEWTON_DEEP_STRIPS(3)
+DEFINE_NEWTON_DEEP_STRIPS(4)
+DEFINE_NEWTON_DEEP_STRIPS(5)
+DEFINE_NEWTON_DEEP_STRIPS(6)
+DEFINE_NEWTON_DEEP_STRIPS(7)
+DEFINE_NEWTON_DEEP_STRIPS(8)
+DEFINE_NEWTON_DEEP_STRIPS(9)
+
+#define NEWTON_DEEP_STRIP_TABLE(prec, isa) { \
+  newton_strip_##prec##_##isa##_1, newton_strip_##prec##_##isa##_2, newton_strip_##prec##_##isa##_3, \
+  newton_strip_##prec##_##isa##_4, newton_strip_##prec##_##isa##_5, newton_strip_##prec##_##isa##_6, \
+  newton_strip_##prec##_##isa##_7, newton_strip_##prec##_##isa##_8, newton_strip_##prec##_##isa##_9 }
+
+// Function to pick the deep strip kernel of a precision (double or dd) and a
+// degree between 1 and 9, see select_newton_isa
+static newton_deep_strip_t select_newton_deep_strip(const char* name, int precision, int degree)
+{
+  static const newton_deep_strip_t doubles[][9] = {
+    NEWTON_DEEP_STRIP_TABLE(double, scalar),
+#ifdef HAVE_X86_KERNELS
+    NEWTON_DEEP_STRIP_TABLE(double, avx2),
+    NEWTON_DEEP_STRIP_TABLE(double, avx512),
+#endif
+  };
+  static const newton_deep_strip_t dds[][9] = {
+    NEWTON_DEEP_STRIP_TABLE(dd, scalar),
+#ifdef HAVE_X86_KERNELS
+    NEWTON_DEEP_STRIP_TABLE(dd, avx2),
+    NEWTON_DEEP_STRIP_TABLE(dd, avx512),
+#endif
+  };
+  int isa = select_newton_isa(name);
+  return precision == precision_dd ? dds[isa][degree - 1] : doubles[isa][degree - 1];
+}
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef NEWTON_KERNELS_H
+#define NEWTON_KERNELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Maximum number of SIMD lanes of a strip kernel
+#define MAX_LANES 16
+
+static const long upper_bnd = 10000000000; // Upper bound constant
+static const float lower_bnd_squared = 0.000001f; // Lower bound squared constant
+static const float root_tol_squared = 0.000001f; // Squared distance at which a root is reached
+static const int max_iter = 128; // Iterations after which a point is given up
+
+// Explicit root solutions for each polynomial degree between 1 and 9
+static const float root_solutions[9][9][2] = {
+  // Solutions for degree 1
+  {{1.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 2
+  {{1.f,0.f}, {-1.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 3
+  {{1.f,0.f}, {-0.5f,0.86603f}, {-0.5f,-0.86603f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 4
+  {{1.f,0.f}, {-1.f,0.f}, {0.f,1.f}, {0.f,-1.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 5
+  {{1.f,0.f}, {0.30902f,0.95106f}, {0.30902f,-0.95106f}, {-0.80902f,0.58779f}, {-0.80902f,-0.58779f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 6
+  {{1.f,0.f}, {-1.f,0.f}, {0.5f,0.86603f}, {-0.5f,-0.86603f}, {-0.5f,0.86603f}, {0.5f,-0.86603f}, {0.f,0.f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 7
+  {{1.f,0.f}, {-0.90097f,-0.43388f}, {-0.90097f,0.43388f}, {-0.22252f,-0.97493f}, {-0.22252f,0.97493f}, {0.62349f,-0.78183f}, {0.62349f,0.78183f}, {0.f,0.f}, {0.f,0.f}},
+  // Solutions for degree 8
+  {{1.f,0.f}, {-1.f,0.f}, {0.f,1.f}, {0.f,-1.f}, {0.70711f,0.70711f}, {-0.70711f,-0.70711f}, {-0.70711f,0.70711f}, {0.70711f,-0.70711f}, {0.f,0.f} },
+  // Solutions for degree 9
+  {{1.f,0.f}, {-0.93969f,-0.34202f}, {-0.93969f,0.34202f}, {0.76604f,0.64279f}, {0.76604f,-0.64279f}, {-0.5f,-0.86603f}, {-0.5f,0.86603f}, {0.17365f,0.98481f}, {0.17365f,-0.98481f}}
+};
+
+// Structure for complex numbers
+typedef struct{
+  float re;
+  float im;
+} complex;
+
+// Structure for returning root and iteration count
+typedef struct {
+  uint8_t root;
+  uint8_t iter;
+} return_tuple;
+
+// Strip kernel: runs the Newton iteration of one degree for the n points
+// (re[j], im[j]) and writes their root (1..degree, 10 if none) and iteration count
+typedef void (*newton_strip_t)(const float*, const float*, int, uint8_t*, uint8_t*);
+
+// Function to perform Newton step for a given polynomial degree. It is inlined
+// with a constant degree, so the switch is resolved at compile time. From
+// degree 4 on the step is z*(d-1)/d + w^(d-1)/d with w = 1/z, which cannot
+// overflow before the divergence check catches |z| > upper_bnd.
+static inline __attribute__((always_inline))
+complex newton_step(const int degree, float x, float y){
+  float denom, x2y2, xnumer, ynumer, wre, wim, pre, pim, t;
+  x2y2=x*x+y*y;
+  switch(degree){
+    case 1:
+      return (complex){1.f, 0.f};
+    case 2:
+      denom = 2*x2y2;
+      return (complex){x*0.5f + x/denom, y*0.5f - y/denom};
+    case 3:
+      denom = 3.f*x2y2*x2y2;
+      xnumer = x*x - y*y;
+      ynumer = 2.f*x*y;
+      return (complex){x*(2.f/3.f) + (xnumer)/denom,y*(2.f/3.f) - ynumer/denom};
+    default:
+      wre = x/x2y2;
+      wim = -y/x2y2;
+      pre = wre;
+      pim = wim;
+      for (int k = 2; k < degree; k++) {
+        t = pre*wre - pim*wim;
+        pim = pre*wim + pim*wre;
+        pre = t;
+      }
+      return (complex){x*((degree - 1.f)/degree) + pre/degree, y*((degree - 1.f)/degree) + pim/degree};
+  }
+}
+
+// Function to run the Newton algorithm for a given starting position in the complex plane
+static inline __attribute__((always_inline))
+return_tuple newton_algorithm(float re, float im, const int degree)
+{
+  float dre, dim;
+
+  for (uint8_t i = 0;; ++i) {
+    // Check if the iteration count exceeds the limit or the point diverges
+    if(fabs(re)>upper_bnd || fabs(im)>upper_bnd || re*re+im*im<lower_bnd_squared || i==max_iter){
+      return (return_tuple){10, i};
+    }
+    // Check for convergence to each root
+    for (int8_t j = 0; j < degree; j++)
+    {
+      dre=re-root_solutions[degree-1][j][0];
+      dim=im-root_solutions[degree-1][j][1];
+      if (dre * dre + dim * dim < root_tol_squared)
+      {
+        return (return_tuple){j+1, i};
+      }
+    }
+
+    // Perform Newton step
+    complex post_step = newton_step(degree, re, im);
+    re = post_step.re;
+    im = post_step.im;
+  }
+}
+
+// Function to iterate a strip one point at a time
+static inline __attribute__((always_inline))
+void newton_strip_scalar_of(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters,
+                            const int degree)
+{
+  for (int j = 0; j < n; ++j) {
+    return_tuple values = newton_algorithm(re[j], im[j], degree);
+    roots[j] = values.root;
+    iters[j] = values.iter;
+  }
+}
+
+// Lanes of a SIMD strip kernel. Each lane iterates one point of the strip;
+// when it reaches a root or gives up its result is written out and the lane
+// is refilled with the next point, so no lane idles while points remain.
+typedef struct {
+  float x[MAX_LANES];
+  float y[MAX_LANES];
+  int32_t iter[MAX_LANES];
+  int32_t root[MAX_LANES];
+  int pixel[MAX_LANES]; // point of the strip in the lane
+  unsigned active; // bit per lane that holds a point
+  int next; // next point of the strip to start
+} newton_lanes_t;
+
+// Function to start the first n_lanes points of a strip
+static inline
+void newton_lanes_init(newton_lanes_t* l, int n_lanes, const float* re, const float* im, int n)
+{
+  l->active = 0;
+  l->next = 0;
+  for (int k = 0; k < n_lanes; k++){
+    l->x[k] = l->y[k] = 0.f;
+    l->iter[k] = 0;
+    if (l->next < n){
+      l->pixel[k] = l->next;
+      l->x[k] = re[l->next];
+      l->y[k] = im[l->next];
+      l->active |= 1u << k;
+      l->next++;
+    }
+  }
+}
+
+// Function to write out the lanes in done and refill them from the strip
+static inline
+void newton_lanes_retire(newton_lanes_t* l, unsigned done, const float* re, const float* im, int n,
+                         uint8_t* roots, uint8_t* iters)
+{
+  for (; done != 0; done &= done - 1){
+    int k = __builtin_ctz(done);
+    roots[l->pixel[k]] = (uint8_t) l->root[k];
+    iters[l->pixel[k]] = (uint8_t) l->iter[k];
+    if (l->next < n){
+      l->pixel[k] = l->next;
+      l->x[k] = re[l->next];
+      l->y[k] = im[l->next];
+      l->iter[k] = 0;
+      l->next++;
+    }
+    else
+      l->active &= ~(1u << k);
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+// Function to perform the Newton step on 8 points, rounding like newton_step
+__attribute__((target("avx2"), always_inline))
+static inline
+void newton_step_avx2(const int degree, __m256* x, __m256* y)
+{
+  __m256 x2y2 = _mm256_add_ps(_mm256_mul_ps(*x, *x), _mm256_mul_ps(*y, *y));
+  __m256 denom, xnumer, ynumer, wre, wim, pre, pim, t;
+  switch(degree){
+    case 1:
+      *x = _mm256_set1_ps(1.f);
+      *y = _mm256_setzero_ps();
+      return;
+    case 2:
+      denom = _mm256_mul_ps(_mm256_set1_ps(2.f), x2y2);
+      *x = _mm256_add_ps(_mm256_mul_ps(*x, _mm256_set1_ps(0.5f)), _mm256_div_ps(*x, denom));
+      *y = _mm256_sub_ps(_mm256_mul_ps(*y, _mm256_set1_ps(0.5f)), _mm256_div_ps(*y, denom));
+      return;
+    case 3:
+      denom = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(3.f), x2y2), x2y2);
+      xnumer = _mm256_sub_ps(_mm256_mul_ps(*x, *x), _mm256_mul_ps(*y, *y));
+      ynumer = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(2.f), *x), *y);
+      *x = _mm256_add_ps(_mm256_mul_ps(*x, _mm256_set1_ps(2.f/3.f)), _mm256_div_ps(xnumer, denom));
+      *y = _mm256_sub_ps(_mm256_mul_ps(*y, _mm256_set1_ps(2.f/3.f)), _mm256_div_ps(ynumer, denom));
+      return;
+    default:
+      wre = _mm256_div_ps(*x, x2y2);
+      wim = _mm256_div_ps(_mm256_xor_ps(*y, _mm256_set1_ps(-0.f)), x2y2);
+      pre = wre;
+      pim = wim;
+      for (int k = 2; k < degree; k++) {
+        t = _mm256_sub_ps(_mm256_mul_ps(pre, wre), _mm256_mul_ps(pim, wim));
+        pim = _mm256_add_ps(_mm256_mul_ps(pre, wim), _mm256_mul_ps(pim, wre));
+        pre = t;
+      }
+      *x = _mm256_add_ps(_mm256_mul_ps(*x, _mm256_set1_ps((degree - 1.f)/degree)),
+                         _mm256_div_ps(pre, _mm256_set1_ps((float) degree)));
+      *y = _mm256_add_ps(_mm256_mul_ps(*y, _mm256_set1_ps((degree - 1.f)/degree)),
+                         _mm256_div_ps(pim, _mm256_set1_ps((float) degree)));
+      return;
+  }
+}
+
+// Function to iterate a strip 8 points at a time
+__attribute__((target("avx2"), always_inline))
+static inline
+void newton_strip_avx2_of(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters,
+                          const int degree)
+{
+  newton_lanes_t l;
+  newton_lanes_init(&l, 8, re, im, n);
+  __m256 x = _mm256_loadu_ps(l.x), y = _mm256_loadu_ps(l.y);
+  __m256i iter = _mm256_setzero_si256();
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 bnd = _mm256_set1_ps((float) upper_bnd);
+
+  while (l.active != 0) {
+    // Diverged, too close to the origin or out of iterations, as in newton_algorithm
+    __m256 found = _mm256_or_ps(_mm256_cmp_ps(_mm256_and_ps(x, abs_mask), bnd, _CMP_GT_OQ),
+                                _mm256_cmp_ps(_mm256_and_ps(y, abs_mask), bnd, _CMP_GT_OQ));
+    __m256 r2 = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+    found = _mm256_or_ps(found, _mm256_cmp_ps(r2, _mm256_set1_ps(lower_bnd_squared), _CMP_LT_OQ));
+    found = _mm256_or_ps(found, _mm256_castsi256_ps(_mm256_cmpeq_epi32(iter, _mm256_set1_epi32(max_iter))));
+    __m256 root = _mm256_castsi256_ps(_mm256_set1_epi32(10));
+
+    // The first root within reach, unless the lane is already done
+    for (int j = 0; j < degree; j++) {
+      __m256 dre = _mm256_sub_ps(x, _mm256_set1_ps(root_solutions[degree-1][j][0]));
+      __m256 dim = _mm256_sub_ps(y, _mm256_set1_ps(root_solutions[degree-1][j][1]));
+      __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dre, dre), _mm256_mul_ps(dim, dim));
+      __m256 hit = _mm256_andnot_ps(found, _mm256_cmp_ps(d2, _mm256_set1_ps(root_tol_squared), _CMP_LT_OQ));
+      root = _mm256_blendv_ps(root, _mm256_castsi256_ps(_mm256_set1_epi32(j + 1)), hit);
+      found = _mm256_or_ps(found, hit);
+    }
+
+    unsigned done = (unsigned) _mm256_movemask_ps(found) & l.active;
+    if (done != 0) {
+      // Retire and refill the finished lanes, the new points are checked before their first step
+      _mm256_storeu_ps(l.x, x);
+      _mm256_storeu_ps(l.y, y);
+      _mm256_storeu_si256((__m256i*) l.iter, iter);
+      _mm256_storeu_si256((__m256i*) l.root, _mm256_castps_si256(root));
+      newton_lanes_retire(&l, done, re, im, n, roots, iters);
+      x = _mm256_loadu_ps(l.x);
+      y = _mm256_loadu_ps(l.y);
+      iter = _mm256_loadu_si256((const __m256i*) l.iter);
+      continue;
+    }
+
+    newton_step_avx2(degree, &x, &y);
+    iter = _mm256_add_epi32(iter, _mm256_set1_epi32(1));
+  }
+}
+
+// Function to perform the Newton step on 16 points, rounding like newton_step
+__attribute__((target("avx512f"), always_inline))
+static inline
+void newton_step_avx512(const int degree, __m512* x, __m512* y)
+{
+  __m512 x2y2 = _mm512_add_ps(_mm512_mul_ps(*x, *x), _mm512_mul_ps(*y, *y));
+  __m512 denom, xnumer, ynumer, wre, wim, pre, pim, t;
+  switch(degree){
+    case 1:
+      *x = _mm512_set1_ps(1.f);
+      *y = _mm512_setzero_ps();
+      return;
+    case 2:
+      denom = _mm512_mul_ps(_mm512_set1_ps(2.f), x2y2);
+      *x = _mm512_add_ps(_mm512_mul_ps(*x, _mm512_set1_ps(0.5f)), _mm512_div_ps(*x, denom));
+      *y = _mm512_sub_ps(_mm512_mul_ps(*y, _mm512_set1_ps(0.5f)), _mm512_div_ps(*y, denom));
+      return;
+    case 3:
+      denom = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(3.f), x2y2), x2y2);
+      xnumer = _mm512_sub_ps(_mm512_mul_ps(*x, *x), _mm512_mul_ps(*y, *y));
+      ynumer = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(2.f), *x), *y);
+      *x = _mm512_add_ps(_mm512_mul_ps(*x, _mm512_set1_ps(2.f/3.f)), _mm512_div_ps(xnumer, denom));
+      *y = _mm512_sub_ps(_mm512_mul_ps(*y, _mm512_set1_ps(2.f/3.f)), _mm512_div_ps(ynumer, denom));
+      return;
+    default:
+      wre = _mm512_div_ps(*x, x2y2);
+      wim = _mm512_div_ps(_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(*y),
+                                                               _mm512_set1_epi32(INT32_MIN))), x2y2);
+      pre = wre;
+      pim = wim;
+      for (int k = 2; k < degree; k++) {
+        t = _mm512_sub_ps(_mm512_mul_ps(pre, wre), _mm512_mul_ps(pim, wim));
+        pim = _mm512_add_ps(_mm512_mul_ps(pre, wim), _mm512_mul_ps(pim, wre));
+        pre = t;
+      }
+      *x = _mm512_add_ps(_mm512_mul_ps(*x, _mm512_set1_ps((degree - 1.f)/degree)),
+                         _mm512_div_ps(pre, _mm512_set1_ps((float) degree)));
+      *y = _mm512_add_ps(_mm512_mul_ps(*y, _mm512_set1_ps((degree - 1.f)/degree)),
+                         _mm512_div_ps(pim, _mm512_set1_ps((float) degree)));
+      return;
+  }
+}
+
+// Function to iterate a strip 16 points at a time
+__attribute__((target("avx512f"), always_inline))
+static inline
+void newton_strip_avx512_of(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters,
+                            const int degree)
+{
+  newton_lanes_t l;
+  newton_lanes_init(&l, 16, re, im, n);
+  __m512 x = _mm512_loadu_ps(l.x), y = _mm512_loadu_ps(l.y);
+  __m512i iter = _mm512_setzero_si512();
+  const __m512 bnd = _mm512_set1_ps((float) upper_bnd);
+
+  while (l.active != 0) {
+    // Diverged, too close to the origin or out of iterations, as in newton_algorithm
+    __mmask16 found = _mm512_cmp_ps_mask(_mm512_abs_ps(x), bnd, _CMP_GT_OQ) |
+                      _mm512_cmp_ps_mask(_mm512_abs_ps(y), bnd, _CMP_GT_OQ);
+    __m512 r2 = _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y));
+    found |= _mm512_cmp_ps_mask(r2, _mm512_set1_ps(lower_bnd_squared), _CMP_LT_OQ);
+    found |= _mm512_cmpeq_epi32_mask(iter, _mm512_set1_epi32(max_iter));
+    __m512i root = _mm512_set1_epi32(10);
+
+    // The first root within reach, unless the lane is already done
+    for (int j = 0; j < degree; j++) {
+      __m512 dre = _mm512_sub_ps(x, _mm512_set1_ps(root_solutions[degree-1][j][0]));
+      __m512 dim = _mm512_sub_ps(y, _mm512_set1_ps(root_solutions[degree-1][j][1]));
+      __m512 d2 = _mm512_add_ps(_mm512_mul_ps(dre, dre), _mm512_mul_ps(dim, dim));
+      __mmask16 hit = _mm512_cmp_ps_mask(d2, _mm512_set1_ps(root_tol_squared), _CMP_LT_OQ) & ~found;
+      root = _mm512_mask_blend_epi32(hit, root, _mm512_set1_epi32(j + 1));
+      found |= hit;
+    }
+
+    unsigned done = (unsigned) found & l.active;
+    if (done != 0) {
+      // Retire and refill the finished lanes, the new points are checked before their first step
+      _mm512_storeu_ps(l.x, x);
+      _mm512_storeu_ps(l.y, y);
+      _mm512_storeu_si512(l.iter, iter);
+      _mm512_storeu_si512(l.root, root);
+      newton_lanes_retire(&l, done, re, im, n, roots, iters);
+      x = _mm512_loadu_ps(l.x);
+      y = _mm512_loadu_ps(l.y);
+      iter = _mm512_loadu_si512(l.iter);
+      continue;
+    }
+
+    newton_step_avx512(degree, &x, &y);
+    iter = _mm512_add_epi32(iter, _mm512_set1_epi32(1));
+  }
+}
+#endif
+
+// Strip kernels specialized for each degree, so that the degree is only
+// dispatched on once per image
+#define DEFINE_NEWTON_STRIP(d) \
+  static void newton_strip_scalar_##d(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters) \
+  { newton_strip_scalar_of(re, im, n, roots, iters, d); }
+#ifdef HAVE_X86_KERNELS
+#define DEFINE_NEWTON_STRIPS(d) \
+  DEFINE_NEWTON_STRIP(d) \
+  __attribute__((target("avx2"))) \
+  static void newton_strip_avx2_##d(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters) \
+  { newton_strip_avx2_of(re, im, n, roots, iters, d); } \
+  __attribute__((target("avx512f"))) \
+  static void newton_strip_avx512_##d(const float* re, const float* im, int n, uint8_t* roots, uint8_t* iters) \
+  { newton_strip_avx512_of(re, im, n, roots, iters, d); }
+#else
+#define DEFINE_NEWTON_STRIPS(d) DEFINE_NEWTON_STRIP(d)
+#endif
+DEFINE_NEWTON_STRIPS(1)
+DEFINE_NEWTON_STRIPS(2)
+DEFINE_NEWTON_STRIPS(3)
+DEFINE_NEWTON_STRIPS(4)
+DEFINE_NEWTON_STRIPS(5)
+DEFINE_NEWTON_STRIPS(6)
+DEFINE_NEWTON_STRIPS(7)
+DEFINE_NEWTON_STRIPS(8)
+DEFINE_NEWTON_STRIPS(9)
+
+#define NEWTON_STRIP_TABLE(isa) { \
+  newton_strip_##isa##_1, newton_strip_##isa##_2, newton_strip_##isa##_3, \
+  newton_strip_##isa##_4, newton_strip_##isa##_5, newton_strip_##isa##_6, \
+  newton_strip_##isa##_7, newton_strip_##isa##_8, newton_strip_##isa##_9 }
+
+// Instruction sets of the strip kernels, the rows of their tables
+enum { isa_scalar, isa_avx2, isa_avx512 };
+
+// Function to pick the instruction set of the strip kernels: the one named
+// (scalar, avx2, avx512) or else the widest one the CPU supports
+static int select_newton_isa(const char* name)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  bool has_avx512 = __builtin_cpu_supports("avx512f");
+  bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (name == NULL)
+    name = has_avx512 ? "avx512" : has_avx2 ? "avx2" : "scalar";
+  if (strcmp(name, "avx512") == 0 && has_avx512)
+    return isa_avx512;
+  if (strcmp(name, "avx2") == 0 && has_avx2)
+    return isa_avx2;
+#endif
+  if (name != NULL && strcmp(name, "scalar") != 0)
+    fprintf(stderr, "kernel %s is not supported, using scalar\n", name);
+  return isa_scalar;
+}
+
+// Function to pick the strip kernel of a degree between 1 and 9, see select_newton_isa
+static newton_strip_t select_newton_strip(const char* name, int degree)
+{
+  static const newton_strip_t strips[][9] = {
+    NEWTON_STRIP_TABLE(scalar),
+#ifdef HAVE_X86_KERNELS
+    NEWTON_STRIP_TABLE(avx2),
+    NEWTON_STRIP_TABLE(avx512),
+#endif
+  };
+  return strips[select_newton_isa(name)][degree - 1];
+}
+
+#endif